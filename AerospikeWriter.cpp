@@ -21,6 +21,11 @@
 
 #include <limits>
 #include <list>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <time.h>
+#include <unistd.h>
 
 static size_t s_max_requests_in_flight = 100;
 static bool s_use_nearest_timeout = false;
@@ -28,6 +33,27 @@ static bool s_use_nearest_timeout = false;
 static uint32_t s_ttl_for_eternal_records = AS_RECORD_NO_EXPIRE_TTL;
 static uint32_t s_minimum_ttl = 1;
 
+// Bin names live for the life of the process, so rows can point at them whatever schema or thread they came from.
+// Each parser thread remembers the names it has seen, so only new ones take the lock.
+static const char * intern_bin_name(const StringView & name)
+{
+    static thread_local std::unordered_map<StringView, const char *, StringViewHash> seen;
+    auto found = seen.find(name);
+    if (found != seen.end())
+    {
+        return found->second;
+    }
+
+    static std::unordered_set<std::string> names;
+    static pthread_mutex_t names_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&names_mutex);
+    const std::string & interned = *names.insert(name.to_string()).first;
+    pthread_mutex_unlock(&names_mutex);
+
+    seen.emplace(StringView(interned), interned.c_str());
+    return interned.c_str();
+}
+
 // Implements virtual functions in CassandraParser::DatabaseRow to receive and process row info
 class AerospikeDatabaseRow : public CassandraParser::DatabaseRow
 {
@@ -37,10 +63,13 @@ public:
         reset();
     }
 
+    // Clearing keeps the capacity, so a row that has been round the pool once needs no more allocations.
     void reset()
     {
         key.clear();
-        columns.clear();
+        bins.clear();
+        arena.clear();
+        blocks.clear();
         if (s_use_nearest_timeout)
         {
             expiry = std::numeric_limits<uint32_t>::max();
@@ -51,35 +80,78 @@ public:
         }
     }
 
-    virtual void new_row(const std::string & key_string) final
+    virtual void new_row(const StringView & key_string) final
     {
-        key = key_string;
+        key.assign(key_string.data(), key_string.size());
     }
 
     // This are for columns with no expiry time set
-    virtual void new_column(const std::string & column_name, const std::string & column_value, int64_t ts) final
+    virtual void new_column(const StringView & column_name, const StringView & column_value, const SharedBlock & value_block, int64_t ts) final
     {
         if (!s_use_nearest_timeout)
         {
             expiry = std::numeric_limits<uint32_t>::max();
         }
-        columns.push_back(std::make_pair(column_name, column_value));
+        add_column(column_name, column_value, value_block);
     }
 
     // This is for columns that do expire.
-    virtual void new_column_with_ttl(const std::string & column_name, const std::string & column_value,
+    virtual void new_column_with_ttl(const StringView & column_name, const StringView & column_value, const SharedBlock & value_block,
                                      int64_t ts, uint32_t ttl, uint32_t ttlTimestampSecs) final
     {
         if ((ttlTimestampSecs < expiry) == s_use_nearest_timeout)
         {
             expiry = ttlTimestampSecs;
         }
-        columns.push_back(std::make_pair(column_name, column_value));
+        add_column(column_name, column_value, value_block);
+    }
+
+    // Values stay in the decompressed chunk (or mapping) they were read from, which the row holds until the write
+    // completes. Only values that were not read straight from one are copied, one after another into the arena.
+    struct Bin
+    {
+        const char * name;
+        // NULL if the value is in the arena at offset.
+        const uint8_t * data;
+        size_t offset;
+        size_t size;
+    };
+
+    const uint8_t * value(const Bin & bin) const
+    {
+        return bin.data != NULL ? bin.data : arena.data() + bin.offset;
     }
 
     std::string key;
-    std::vector<std::pair<std::string, std::string>> columns;
+    std::vector<Bin> bins;
+    std::vector<uint8_t> arena;
+    // Each block once, as consecutive values are nearly always in the same one.
+    std::vector<SharedBlock> blocks;
     uint32_t expiry;
+
+private:
+    void add_column(const StringView & name, const StringView & value, const SharedBlock & block)
+    {
+        Bin bin;
+        bin.name = intern_bin_name(name);
+        bin.size = value.size();
+        if (block)
+        {
+            if (blocks.empty() || blocks.back() != block)
+            {
+                blocks.push_back(block);
+            }
+            bin.data = reinterpret_cast<const uint8_t *>(value.data());
+            bin.offset = 0;
+        }
+        else
+        {
+            bin.data = NULL;
+            bin.offset = arena.size();
+            arena.insert(arena.end(), value.data(), value.data() + value.size());
+        }
+        bins.push_back(bin);
+    }
 };
 
 // This is an object with a pointer to the AerospikeWriter as well as the ability to work
@@ -105,14 +177,9 @@ public:
         next_node = nullptr;
     }
 
-    static void free_row_list(DatabaseRowWithWriter *& list)
+    void set_writer(AerospikeWriter * w)
     {
-        while (list != nullptr)
-        {
-            DatabaseRowWithWriter * previous = list;
-            list = list->next_node;
-            delete previous;
-        }
+        writer = w;
     }
 
     bool handle_error_and_retry(as_error* err);
@@ -127,7 +194,13 @@ public:
     WriteReturnValue write(as_event_loop* event_loop, aerospike & connection, const as_namespace & ns, const as_set & set,
                as_error & err);
     DatabaseRowWithWriter * next() { return next_node; }
+    bool is_before(const DatabaseRowWithWriter & other) const
+    {
+        return range < other.range || (range == other.range && ordinal < other.ordinal);
+    }
 
+    // Rows are ordered by the range they were read from, then the order they were read within that range.
+    size_t range;
     uint64_t ordinal;
 private:
     AerospikeWriter * writer;
@@ -220,13 +293,13 @@ DatabaseRowWithWriter::WriteReturnValue DatabaseRowWithWriter::write(as_event_lo
                      reinterpret_cast<const uint8_t *>(key.data()), key.size(), false);
 
     as_record rec;
-    as_record_inita(&rec, columns.size());
+    as_record_inita(&rec, bins.size());
 
-    for (const auto & column : columns)
+    // The command is serialized before aerospike_key_put_async() returns, but the row keeps its values (and the
+    // blocks holding them) in case it has to be resent, until write_listener returns it to the pool.
+    for (const Bin & bin : bins)
     {
-        as_record_set_raw(&rec, column.first.c_str(),
-                          reinterpret_cast<const uint8_t *>(column.second.data()),
-                          column.second.length());
+        as_record_set_rawp(&rec, bin.name, value(bin), uint32_t(bin.size), false);
     }
 
     if (expiry == std::numeric_limits<uint32_t>::max())
@@ -257,10 +330,223 @@ DatabaseRowWithWriter::WriteReturnValue DatabaseRowWithWriter::write(as_event_lo
 
 bool AerospikeWriter::s_terminated = false;
 
-AerospikeWriter::~AerospikeWriter()
+// How often a parser waiting for a spare row looks to see whether it should stop.
+static const long TERMINATION_CHECK_NS = 100 * 1000 * 1000;
+
+RowProducer::RowProducer(TokenRangeScheduler & s, size_t n_threads, size_t n_rows) :
+    scheduler(s),
+    ready_rows(n_rows),
+    spare_rows(n_rows),
+    threads(std::max(n_threads, size_t(1))),
+    running_threads(0),
+    writers(nullptr),
+    spare_count(n_rows),
+    wake_batch(std::max(n_rows / 8, size_t(1))),
+    waiting_parsers(0)
+{
+    pthread_mutex_init(&spare_lock, nullptr);
+    pthread_cond_init(&spare_available, nullptr);
+    all_rows.resize(n_rows);
+    for (auto & row : all_rows)
+    {
+        row.reset(new DatabaseRowWithWriter(nullptr));
+        spare_rows.push(row.get());
+    }
+}
+
+RowProducer::~RowProducer()
+{
+    pthread_cond_destroy(&spare_available);
+    pthread_mutex_destroy(&spare_lock);
+}
+
+bool RowProducer::start(std::vector<AerospikeWriter> & writers_to_wake)
+{
+    writers = &writers_to_wake;
+    starved_writers.reset(new std::atomic<bool>[writers->size()]);
+    for (size_t i = 0; i < writers->size(); i++)
+    {
+        starved_writers[i].store(false);
+    }
+
+    running_threads = threads.size();
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        if (pthread_create(&threads[i], nullptr, &RowProducer::thread_main, this) != 0)
+        {
+            fprintf(stderr, "ERROR: cannot create parser thread %d\n", errno);
+            running_threads -= threads.size() - i;
+            threads.resize(i);
+            return false;
+        }
+    }
+    return true;
+}
+
+void RowProducer::join()
+{
+    for (pthread_t thread : threads)
+    {
+        pthread_join(thread, nullptr);
+    }
+    threads.clear();
+}
+
+void * RowProducer::thread_main(void * producer)
+{
+    static_cast<RowProducer *>(producer)->run();
+    return nullptr;
+}
+
+// Each parser thread takes ranges from the scheduler until they are all gone.
+void RowProducer::run()
+{
+    size_t range_index;
+    CassandraParser::iterator * iterator;
+    while (!AerospikeWriter::terminated() && (iterator = scheduler.next_range(range_index)) != nullptr)
+    {
+        while (DatabaseRowWithWriter * row = wait_for_spare_row())
+        {
+            row->range = range_index;
+            row->ordinal = iterator->getCassandraReadRecords();
+            if (!iterator->next(*row))
+            {
+                return_row(row);
+                scheduler.finish_range(range_index);
+                break;
+            }
+
+            // There are only as many rows as the queue can hold, so this cannot fail.
+            ready_rows.push(row);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            for (size_t i = 0; i < writers->size(); i++)
+            {
+                if (starved_writers[i].exchange(false))
+                {
+                    wake_writer(i);
+                    break;
+                }
+            }
+        }
+    }
+
+    // The last thread out lets the writers know that there is nothing left.
+    if (--running_threads == 0)
+    {
+        for (size_t i = 0; i < writers->size(); i++)
+        {
+            if (starved_writers[i].exchange(false))
+            {
+                wake_writer(i);
+            }
+        }
+    }
+}
+
+// Waits until writers have sent enough rows that one can be reused. Returns nullptr on termination.
+DatabaseRowWithWriter * RowProducer::wait_for_spare_row()
+{
+    DatabaseRowWithWriter * row;
+    if (spare_rows.pop(row))
+    {
+        spare_count--;
+        return row;
+    }
+
+    // Announce the wait, then look again in case a row was returned before the announcement was seen.
+    pthread_mutex_lock(&spare_lock);
+    waiting_parsers++;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!spare_rows.pop(row))
+    {
+        if (AerospikeWriter::terminated())
+        {
+            row = nullptr;
+            break;
+        }
+        // Termination is requested from a signal handler, which cannot signal the condition, so it is checked
+        // for every so often.
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TERMINATION_CHECK_NS;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&spare_available, &spare_lock, &deadline);
+    }
+    waiting_parsers--;
+    pthread_mutex_unlock(&spare_lock);
+    if (row != nullptr)
+    {
+        spare_count--;
+    }
+    return row;
+}
+
+// Event loops may only be used from their own thread, so this asks the loop to call the writer.
+void RowProducer::wake_writer(size_t index)
+{
+    (*writers)[index].resume();
+}
+
+DatabaseRowWithWriter * RowProducer::take_row(size_t writer_index)
+{
+    DatabaseRowWithWriter * row;
+    if (ready_rows.pop(row))
+    {
+        return row;
+    }
+
+    // Ask to be woken, then look again in case a row arrived before the request was seen.
+    starved_writers[writer_index].store(true);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ready_rows.pop(row))
+    {
+        starved_writers[writer_index].store(false);
+        return row;
+    }
+    return nullptr;
+}
+
+void RowProducer::return_row(DatabaseRowWithWriter * row)
+{
+    row->reset();
+    spare_rows.push(row);
+    // The count is only decremented after a row is taken, so it never falls short, and once every row is back it
+    // is at least a batch. A parser cannot wait forever.
+    const size_t n_spare = ++spare_count;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (n_spare >= wake_batch && waiting_parsers.load() > 0)
+    {
+        pthread_mutex_lock(&spare_lock);
+        pthread_cond_broadcast(&spare_available);
+        pthread_mutex_unlock(&spare_lock);
+    }
+}
+
+// Takes back the rows that have been parsed but will not be sent. Only valid once everything has stopped.
+void RowProducer::collect_unsent_rows()
 {
-    DatabaseRowWithWriter::free_row_list(failed_requests);
-    DatabaseRowWithWriter::free_row_list(spare_requests);
+    DatabaseRowWithWriter * row;
+    while (ready_rows.pop(row))
+    {
+        unsent_rows.push_back(row);
+    }
+}
+
+DatabaseRowWithWriter * RowProducer::get_first_unsent_row() const
+{
+    DatabaseRowWithWriter * best_row = nullptr;
+    for (DatabaseRowWithWriter * row : unsent_rows)
+    {
+        if (best_row == nullptr || row->is_before(*best_row))
+        {
+            best_row = row;
+        }
+    }
+    return best_row;
 }
 
 // Return the first failed request in the list for retry.
@@ -278,22 +564,16 @@ DatabaseRowWithWriter * AerospikeWriter::get_failed_request()
     return row;
 }
 
-// Create a new row object
+// Take the next parsed row, or nullptr if there are none ready
 DatabaseRowWithWriter * AerospikeWriter::make_row()
 {
-    requests_in_flight++;
-    if (spare_requests)
-    {
-        // Take a spare request off the pool if there is one.
-        DatabaseRowWithWriter * row = spare_requests;
-        row->unlink(spare_requests);
-        return row;
-    }
-    else
+    DatabaseRowWithWriter * row = producer.take_row(writer_index);
+    if (row)
     {
-        // Otherwise, make a new one.
-        return new DatabaseRowWithWriter(this);
+        requests_in_flight++;
+        row->set_writer(this);
     }
+    return row;
 }
 
 // When a row is no longer used, it can be put in this pool.
@@ -301,8 +581,7 @@ void AerospikeWriter::return_row_to_pool(DatabaseRowWithWriter * row)
 {
     requests_in_flight--;
 
-    row->reset();
-    row->link(spare_requests);
+    producer.return_row(row);
 }
 
 // When a row failed to send, put it in a list to send later
@@ -331,24 +610,21 @@ try_another_row:
     if (row == nullptr)
     {
         row = make_row();
-        if (iterator_mutex)
+        if (row == nullptr)
         {
-            pthread_mutex_lock(iterator_mutex);
-        }
-
-        row->ordinal = iterator.getCassandraReadRecords();
-        bool no_more_records = !iterator.next(*row);
-
-        if (iterator_mutex)
-        {
-            pthread_mutex_unlock(iterator_mutex);
-        }
+            if (!producer.finished())
+            {
+                // The producer will call resume_listener once there is something to send.
+                return false;
+            }
 
-        if (no_more_records)
-        {
-            return_row_to_pool(row);
-            set_status_if_no_queries_in_flight(FINISHED);
-            return false;
+            // Everything the parser produced is visible once it has finished, so look one last time.
+            row = make_row();
+            if (row == nullptr)
+            {
+                set_status_if_no_queries_in_flight(FINISHED);
+                return false;
+            }
         }
     }
 
@@ -379,6 +655,22 @@ try_another_row:
     goto try_another_row;
 }
 
+// Restarts a writer on its own event loop, either because it ran out of parsed rows or it has stalled.
+void AerospikeWriter::resume_listener(as_event_loop* event_loop, void* udata)
+{
+    AerospikeWriter * writer = static_cast<AerospikeWriter *>(udata);
+    if (writer->get_requests_in_flight() < s_max_requests_in_flight)
+    {
+        writer->write_next(event_loop);
+    }
+}
+
+// Have write_next called on the writer's own event loop thread.
+bool AerospikeWriter::resume()
+{
+    return as_event_execute(as_event_loop_get_by_index(uint32_t(writer_index)), &AerospikeWriter::resume_listener, this);
+}
+
 // When there are queries in flight, status should always be RUNNING. Otherwise it might be FINISHED or STALLED
 void AerospikeWriter::set_status_if_no_queries_in_flight(WriterStatus new_status)
 {
@@ -410,6 +702,11 @@ void AerospikeWriter::set_max_records_in_flight(size_t n_records)
     s_max_requests_in_flight = n_records;
 }
 
+size_t AerospikeWriter::get_max_records_in_flight()
+{
+    return s_max_requests_in_flight;
+}
+
 void AerospikeWriter::terminate()
 {
     s_terminated = true;
@@ -420,16 +717,17 @@ void AerospikeWriter::set_use_nearest_timeout()
     s_use_nearest_timeout = true;
 }
 
-// Find the oldest record that is in the list of failed records waiting for resend.
-bool AerospikeWriter::get_first_unsent_record(std::string & string, const std::vector<AerospikeWriter> & writers)
+// Find the oldest record that is in the list of failed records waiting for resend, or has not been read yet.
+bool AerospikeWriter::get_first_unsent_record(std::string & string, const std::vector<AerospikeWriter> & writers,
+                                              RowProducer & producer, TokenRangeScheduler & scheduler)
 {
-    DatabaseRowWithWriter * best_row = nullptr;
+    DatabaseRowWithWriter * best_row = producer.get_first_unsent_row();
     for (const AerospikeWriter & writer : writers)
     {
         DatabaseRowWithWriter * next_row = writer.failed_requests;
         while(next_row)
         {
-            if (best_row == nullptr || next_row->ordinal < best_row->ordinal)
+            if (best_row == nullptr || next_row->is_before(*best_row))
             {
                 best_row = next_row;
             }
@@ -437,10 +735,20 @@ bool AerospikeWriter::get_first_unsent_record(std::string & string, const std::v
         }
     }
 
-    if (best_row)
+    std::string unread_key;
+    size_t unread_range;
+    const bool has_unread = scheduler.get_next_key(unread_key, unread_range);
+
+    // Unsent rows were read before anything still left in their range.
+    if (best_row && (!has_unread || best_row->range <= unread_range))
     {
         string = best_row->key;
         return true;
     }
+    else if (has_unread)
+    {
+        string = unread_key;
+        return true;
+    }
     return false;
 }
@@ -18,7 +18,9 @@
 #ifndef AerospikeWriter_hpp
 #define AerospikeWriter_hpp
 
+#include "BoundedQueue.hpp"
 #include "CassandraParser.hpp"
+#include "TokenRanges.hpp"
 
 extern "C"
 {
@@ -30,8 +32,61 @@ extern "C"
 }
 
 
+class AerospikeWriter;
 class DatabaseRowWithWriter;
 
+// Runs the Cassandra parser on its own threads, so that the event threads only need to send rows.
+// Parsed rows are passed through a lock-free queue. There are a fixed number of rows, so parsing will
+// wait when the writers fall behind.
+class RowProducer
+{
+    TokenRangeScheduler & scheduler;
+    std::vector<std::unique_ptr<DatabaseRowWithWriter>> all_rows;
+    BoundedQueue<DatabaseRowWithWriter *> ready_rows;
+    BoundedQueue<DatabaseRowWithWriter *> spare_rows;
+    std::vector<pthread_t> threads;
+    std::atomic<size_t> running_threads;
+    std::unique_ptr<std::atomic<bool>[]> starved_writers;
+    std::vector<AerospikeWriter> * writers;
+    std::vector<DatabaseRowWithWriter *> unsent_rows;
+    // Parsers with no spare row sleep on spare_available. Writers wake them once a batch of rows has come back,
+    // rather than for every row, so that each wake up is worth a context switch.
+    std::atomic<size_t> spare_count;
+    const size_t wake_batch;
+    std::atomic<size_t> waiting_parsers;
+    pthread_mutex_t spare_lock;
+    pthread_cond_t spare_available;
+
+    RowProducer(const RowProducer & other) = delete;
+    RowProducer operator=(const RowProducer & other) = delete;
+
+    static void * thread_main(void * producer);
+    void run();
+    DatabaseRowWithWriter * wait_for_spare_row();
+    void wake_writer(size_t index);
+public:
+    RowProducer(TokenRangeScheduler & s, size_t n_threads, size_t n_rows);
+    ~RowProducer();
+
+    bool start(std::vector<AerospikeWriter> & writers_to_wake);
+    void join();
+
+    // Returns nullptr if nothing is ready. The writer will then be woken when there is.
+    DatabaseRowWithWriter * take_row(size_t writer_index);
+    void return_row(DatabaseRowWithWriter * row);
+    bool finished() const
+    {
+        return running_threads.load() == 0;
+    }
+
+    void collect_unsent_rows();
+    size_t get_unsent_count() const
+    {
+        return unsent_rows.size();
+    }
+    DatabaseRowWithWriter * get_first_unsent_row() const;
+};
+
 // This is a class that represents one thread's worth of Aerospike context.
 // Each event thread has one of these to keep it full of data.
 class AerospikeWriter
@@ -40,10 +95,9 @@ class AerospikeWriter
     as_namespace aero_namespace;
     as_set aero_set;
     size_t requests_in_flight;
-    CassandraParser::iterator & iterator;
+    RowProducer & producer;
+    size_t writer_index;
     DatabaseRowWithWriter * failed_requests;
-    DatabaseRowWithWriter * spare_requests;
-    pthread_mutex_t *iterator_mutex;
     pthread_mutex_t *status_lock;
     pthread_cond_t *check_status;
     size_t existing_entries;
@@ -60,13 +114,12 @@ public:
     };
     WriterStatus writerStatus;
 
-    AerospikeWriter(CassandraParser::iterator & it, aerospike & connection, const char * ns, const char * set, pthread_mutex_t *m, pthread_mutex_t *sl, pthread_cond_t *cs) :
+    AerospikeWriter(RowProducer & p, size_t index, aerospike & connection, const char * ns, const char * set, pthread_mutex_t *sl, pthread_cond_t *cs) :
     as(connection),
     requests_in_flight(0),
-    iterator(it),
+    producer(p),
+    writer_index(index),
     failed_requests(nullptr),
-    spare_requests(nullptr),
-    iterator_mutex(m),
     status_lock(sl),
     check_status(cs),
     existing_entries(0),
@@ -78,8 +131,6 @@ public:
         strncpy(aero_set, set, sizeof(aero_set));
     }
 
-    ~AerospikeWriter();
-
     DatabaseRowWithWriter * get_failed_request();
     DatabaseRowWithWriter * make_row();
     void return_row_to_pool(DatabaseRowWithWriter * row);
@@ -87,6 +138,8 @@ public:
     void set_status_if_no_queries_in_flight(WriterStatus new_status);
 
     bool write_next(as_event_loop* event_loop);
+    bool resume();
+    static void resume_listener(as_event_loop* event_loop, void* udata);
 
     WriterStatus get_status() const
     {
@@ -131,13 +184,15 @@ public:
     static void set_prohibit_eternal_records();
     static void set_minimum_ttl(uint32_t ttl);
     static void set_max_records_in_flight(size_t n_records);
+    static size_t get_max_records_in_flight();
     static void set_use_nearest_timeout();
     static void terminate();
     static bool terminated()
     {
         return s_terminated;
     }
-    static bool get_first_unsent_record(std::string & string, const std::vector<AerospikeWriter> & writers);
+    static bool get_first_unsent_record(std::string & string, const std::vector<AerospikeWriter> & writers,
+                                        RowProducer & producer, TokenRangeScheduler & scheduler);
 };
 
 
@@ -0,0 +1,256 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  AsyncReader.cpp
+//  Keeps many file reads in flight at once using io_uring.
+
+#include "AsyncReader.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+static int64_t now_nanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+AsyncReader * AsyncReader::create(size_t queue_depth, size_t buffer_size)
+{
+    io_uring * ring = new io_uring;
+    int ret = io_uring_queue_init(unsigned(queue_depth), ring, 0);
+    if (ret < 0)
+    {
+        fprintf(stderr, "Cannot use io_uring (%s), reading synchronously\n", strerror(-ret));
+        delete ring;
+        return nullptr;
+    }
+
+    // Align the buffers so that they would also work with O_DIRECT.
+    const size_t page_size = 4096;
+    buffer_size = (buffer_size + page_size - 1) & ~(page_size - 1);
+    void * memory = nullptr;
+    if (posix_memalign(&memory, page_size, buffer_size * queue_depth) != 0)
+    {
+        fprintf(stderr, "Cannot allocate %zu bytes for io_uring buffers\n", buffer_size * queue_depth);
+        io_uring_queue_exit(ring);
+        delete ring;
+        return nullptr;
+    }
+
+    std::vector<struct iovec> iovecs(queue_depth);
+    for (size_t i = 0; i < queue_depth; i++)
+    {
+        iovecs[i].iov_base = static_cast<uint8_t *>(memory) + i * buffer_size;
+        iovecs[i].iov_len = buffer_size;
+    }
+    ret = io_uring_register_buffers(ring, iovecs.data(), unsigned(queue_depth));
+    if (ret < 0)
+    {
+        fprintf(stderr, "Cannot register io_uring buffers (%s), reading synchronously\n", strerror(-ret));
+        free(memory);
+        io_uring_queue_exit(ring);
+        delete ring;
+        return nullptr;
+    }
+
+    return new AsyncReader(ring, queue_depth, buffer_size, static_cast<uint8_t *>(memory));
+}
+
+AsyncReader::AsyncReader(io_uring * ring, size_t queue_depth, size_t buffer_size, uint8_t * memory) :
+    m_ring(ring),
+    m_buffer_size(buffer_size),
+    m_memory(memory),
+    m_requests(queue_depth),
+    m_in_flight(0),
+    m_reads(0),
+    m_bytes(0),
+    m_depth_time(0),
+    m_busy_time(0),
+    m_last_change(0)
+{
+    pthread_mutex_init(&m_mutex, nullptr);
+    pthread_cond_init(&m_buffer_free, nullptr);
+
+    // Handed out from the back, so buffer 0 is used first.
+    for (size_t i = queue_depth; i > 0; i--)
+    {
+        m_free_buffers.push_back(i - 1);
+    }
+
+    pthread_create(&m_completion_thread, nullptr, &AsyncReader::thread_main, this);
+}
+
+AsyncReader::~AsyncReader()
+{
+    // A no-op with no request attached tells the completion thread to stop.
+    pthread_mutex_lock(&m_mutex);
+    io_uring_sqe * sqe = io_uring_get_sqe(m_ring);
+    io_uring_prep_nop(sqe);
+    io_uring_sqe_set_data(sqe, nullptr);
+    io_uring_submit(m_ring);
+    pthread_mutex_unlock(&m_mutex);
+
+    pthread_join(m_completion_thread, nullptr);
+
+    io_uring_unregister_buffers(m_ring);
+    io_uring_queue_exit(m_ring);
+    delete m_ring;
+    free(m_memory);
+
+    pthread_cond_destroy(&m_buffer_free);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+// Must be called with m_mutex held.
+void AsyncReader::account_in_flight(int change)
+{
+    const int64_t now = now_nanoseconds();
+    if (m_in_flight > 0)
+    {
+        m_depth_time += double(m_in_flight) * (now - m_last_change);
+        m_busy_time += now - m_last_change;
+    }
+    m_last_change = now;
+    m_in_flight += change;
+}
+
+bool AsyncReader::read(int fd, int64_t offset, size_t len, Callback done)
+{
+    if (len > m_buffer_size)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    while (m_free_buffers.empty())
+    {
+        pthread_cond_wait(&m_buffer_free, &m_mutex);
+    }
+    const size_t buffer_id = m_free_buffers.back();
+    m_free_buffers.pop_back();
+
+    Request & request = m_requests[buffer_id];
+    request.done = std::move(done);
+
+    // There are no more requests than buffers, so the submission queue cannot be full.
+    io_uring_sqe * sqe = io_uring_get_sqe(m_ring);
+    io_uring_prep_read_fixed(sqe, fd, m_memory + buffer_id * m_buffer_size, unsigned(len), offset, int(buffer_id));
+    io_uring_sqe_set_data(sqe, &request);
+    io_uring_submit(m_ring);
+    account_in_flight(1);
+    pthread_mutex_unlock(&m_mutex);
+    return true;
+}
+
+void AsyncReader::release(size_t buffer_id)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_free_buffers.push_back(buffer_id);
+    pthread_cond_signal(&m_buffer_free);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void * AsyncReader::thread_main(void * reader)
+{
+    static_cast<AsyncReader *>(reader)->run();
+    return nullptr;
+}
+
+void AsyncReader::run()
+{
+    for (;;)
+    {
+        io_uring_cqe * cqe;
+        int ret = io_uring_wait_cqe(m_ring, &cqe);
+        if (ret == -EINTR)
+        {
+            continue;
+        }
+        else if (ret < 0)
+        {
+            fprintf(stderr, "io_uring_wait_cqe failed (%s)\n", strerror(-ret));
+            exit(-1);
+        }
+
+        Request * request = static_cast<Request *>(io_uring_cqe_get_data(cqe));
+        const ssize_t result = cqe->res;
+        io_uring_cqe_seen(m_ring, cqe);
+        if (request == nullptr)
+        {
+            return;
+        }
+
+        const size_t buffer_id = size_t(request - m_requests.data());
+        pthread_mutex_lock(&m_mutex);
+        account_in_flight(-1);
+        m_reads++;
+        m_bytes += result > 0 ? result : 0;
+        pthread_mutex_unlock(&m_mutex);
+
+        Callback done;
+        std::swap(done, request->done);
+        done(m_memory + buffer_id * m_buffer_size, result, buffer_id);
+    }
+}
+
+AsyncReader::Statistics AsyncReader::get_statistics()
+{
+    pthread_mutex_lock(&m_mutex);
+    account_in_flight(0);
+    Statistics statistics;
+    statistics.reads = m_reads;
+    statistics.bytes = m_bytes;
+    statistics.average_queue_depth = m_busy_time > 0 ? m_depth_time / m_busy_time : 0;
+    statistics.bytes_per_second = m_busy_time > 0 ? m_bytes * 1e9 / m_busy_time : 0;
+    pthread_mutex_unlock(&m_mutex);
+    return statistics;
+}
+
+#else // HAVE_LIBURING
+
+AsyncReader * AsyncReader::create(size_t queue_depth, size_t buffer_size)
+{
+    fprintf(stderr, "This build does not support io_uring, reading synchronously\n");
+    return nullptr;
+}
+
+AsyncReader::~AsyncReader()
+{
+}
+
+bool AsyncReader::read(int fd, int64_t offset, size_t len, Callback done)
+{
+    return false;
+}
+
+void AsyncReader::release(size_t buffer_id)
+{
+}
+
+AsyncReader::Statistics AsyncReader::get_statistics()
+{
+    Statistics statistics;
+    memset(&statistics, 0, sizeof(statistics));
+    return statistics;
+}
+
+#endif // HAVE_LIBURING
@@ -0,0 +1,92 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  AsyncReader.hpp
+//  Keeps many file reads in flight at once using io_uring.
+
+#ifndef AsyncReader_hpp
+#define AsyncReader_hpp
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <vector>
+
+struct io_uring;
+
+// Every CompressedBuffer shares the one ring, so even though each SSTable is read in order the device sees
+// reads for all of them at once. Reads complete into buffers that are registered with the kernel up front.
+class AsyncReader
+{
+public:
+    // Called on the completion thread with the number of bytes read (or -errno). The data stays valid until
+    // release(buffer_id) is called, which may be done from any thread.
+    typedef std::function<void(const uint8_t * data, ssize_t result, size_t buffer_id)> Callback;
+
+    struct Statistics
+    {
+        uint64_t reads;
+        uint64_t bytes;
+        // Averaged over the time any read was in flight.
+        double average_queue_depth;
+        double bytes_per_second;
+    };
+
+    // Returns nullptr (having said why) if io_uring is not available.
+    static AsyncReader * create(size_t queue_depth, size_t buffer_size);
+    ~AsyncReader();
+
+    size_t buffer_size() const { return m_buffer_size; }
+
+    // Blocks while every buffer is in use. Returns false if len is larger than a buffer.
+    bool read(int fd, int64_t offset, size_t len, Callback done);
+    void release(size_t buffer_id);
+
+    Statistics get_statistics();
+
+private:
+    struct Request
+    {
+        Callback done;
+    };
+
+    io_uring * m_ring;
+    size_t m_buffer_size;
+    uint8_t * m_memory;
+    std::vector<Request> m_requests;
+    std::vector<size_t> m_free_buffers;
+    pthread_t m_completion_thread;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_buffer_free;
+
+    size_t m_in_flight;
+    uint64_t m_reads;
+    uint64_t m_bytes;
+    // Integral of m_in_flight over time, and the total time it was non-zero (both in nanoseconds).
+    double m_depth_time;
+    double m_busy_time;
+    int64_t m_last_change;
+
+    AsyncReader(io_uring * ring, size_t queue_depth, size_t buffer_size, uint8_t * memory);
+    AsyncReader(const AsyncReader & other) = delete;
+    AsyncReader operator=(const AsyncReader & other) = delete;
+
+    static void * thread_main(void * reader);
+    void run();
+    void account_in_flight(int change);
+};
+
+#endif /* AsyncReader_hpp */
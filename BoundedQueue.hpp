@@ -0,0 +1,135 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  BoundedQueue.hpp
+//  Fixed size lock-free queue for any number of producers and consumers.
+
+#ifndef BoundedQueue_hpp
+#define BoundedQueue_hpp
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+// This is Dmitry Vyukov's bounded MPMC queue. Each cell carries a sequence number that says whether it is
+// ready to be written (sequence == position) or read (sequence == position + 1) on this lap of the ring.
+template<class T>
+class BoundedQueue
+{
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> m_buffer;
+    size_t m_mask;
+    // Keep the producer and consumer positions on separate cache lines.
+    char m_pad0[64];
+    std::atomic<size_t> m_enqueue_pos;
+    char m_pad1[64];
+    std::atomic<size_t> m_dequeue_pos;
+    char m_pad2[64];
+
+    BoundedQueue(const BoundedQueue & other) = delete;
+    BoundedQueue operator=(const BoundedQueue & other) = delete;
+public:
+    // The capacity is rounded up to a power of two.
+    explicit BoundedQueue(size_t min_capacity) :
+        m_enqueue_pos(0),
+        m_dequeue_pos(0)
+    {
+        size_t capacity = 2;
+        while (capacity < min_capacity)
+        {
+            capacity <<= 1;
+        }
+        m_buffer.reset(new Cell[capacity]);
+        m_mask = capacity - 1;
+        for (size_t i = 0; i < capacity; i++)
+        {
+            m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+    // Returns false if the queue is full.
+    bool push(const T & data)
+    {
+        Cell * cell;
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &m_buffer[pos & m_mask];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+            if (diff == 0)
+            {
+                if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = data;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if the queue is empty.
+    bool pop(T & data)
+    {
+        Cell * cell;
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &m_buffer[pos & m_mask];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+            if (diff == 0)
+            {
+                if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        data = cell->data;
+        cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+#endif /* BoundedQueue_hpp */
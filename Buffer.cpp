@@ -16,17 +16,33 @@
 //  Abstraction for Cassandra DB buffers, including decompression
 
 #include "Buffer.hpp"
+#include "AsyncReader.hpp"
+#include "Checksum.hpp"
+#include "ThreadPool.hpp"
 #include "lz4.h"
 #include "snappy.h"
 
-#include <alloca.h>
 #include <assert.h>
+#include <limits.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <zlib.h>
 
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <iostream>
 
@@ -41,23 +57,8 @@
 #include <sys/endian.h>
 #endif
 
-template<class T>
-static T read_from_buffer(Buffer & b)
-{
-    const uint8_t * data = b.read_bytes(sizeof(T));
-    if (data)
-    {
-        return *reinterpret_cast<const T*>(data);
-    }
-    return 0;
-}
-
-int32_t Buffer::read_int()
-{
-    return static_cast<int32_t>(be32toh(read_from_buffer<uint32_t>(*this)));
-}
-
-uint64_t Buffer::read_unsigned_vint()
+// Used near the end of the window, where the vint may be split across chunks.
+uint64_t Buffer::read_unsigned_vint_slow()
 {
     const uint8_t * firstByte = read_bytes(1);
     if (firstByte == nullptr)
@@ -65,15 +66,12 @@ uint64_t Buffer::read_unsigned_vint()
         return 0;
     }
 
-    if (*firstByte < 0x7f)
+    if (*firstByte < 0x80)
     {
         return *firstByte;
     }
 
-    int extraBytes = 0;
-    // Count the number of leading ones in the first byte to find out how many subsequent bytes are needed.
-    for (; extraBytes < 8 && (*firstByte & (0x80 >> extraBytes)) != 0; extraBytes++)
-        ;
+    const int extraBytes = __builtin_clz(~(uint32_t(*firstByte) << 24));
 
     // The leading ones are masked away
     uint64_t retval = *firstByte & (0xff >> extraBytes);
@@ -92,52 +90,68 @@ uint64_t Buffer::read_unsigned_vint()
     return retval;
 }
 
-int64_t Buffer::read_vint()
+void Buffer::read_unsigned_vints(uint64_t * values, size_t count)
 {
-    // This is a zig-zag encoded signed integer
-    int64_t n = read_unsigned_vint();
-    return (n << 1) ^ (n >> 63);
-}
+    for (size_t i = 0; i < count; i++)
+    {
+        // Decode straight out of the window for as long as the longest vint would fit.
+        const uint8_t * cursor = m_cursor;
+        const uint8_t * const safe_end = m_limit - std::min(size_t(m_limit - m_cursor), size_t(9));
+        while (i < count && cursor < safe_end)
+        {
+            values[i++] = decode_unsigned_vint(cursor);
+        }
+        m_cursor = cursor;
 
-int16_t Buffer::read_short()
-{
-    return static_cast<int16_t>(be16toh(read_from_buffer<uint16_t>(*this)));
+        if (i < count)
+        {
+            values[i] = read_unsigned_vint_slow();
+        }
+    }
 }
 
-uint8_t Buffer::read_byte()
+int64_t Buffer::read_vint()
 {
-    return *read_bytes(1);
+    // This is a zig-zag encoded signed integer
+    int64_t n = read_unsigned_vint();
+    return (n << 1) ^ (n >> 63);
 }
 
-std::string Buffer::read_string()
+StringView Buffer::read_string_view()
 {
     int16_t len = read_short();
     if (is_eof())
-        return "";
+        return StringView();
 
     const uint8_t * data = read_bytes(len);
     if (data == NULL)
-        return "";
+        return StringView();
 
-    return std::string((const char*)data, (size_t)len);
+    return StringView((const char*)data, (size_t)len);
 }
 
-std::string Buffer::read_vint_length_string()
+StringView Buffer::read_vint_length_string_view()
 {
     int64_t len = read_unsigned_vint();
     if (is_eof())
-        return "";
+        return StringView();
 
     const uint8_t * data = read_bytes(len);
     if (data == NULL)
-        return "";
+        return StringView();
 
-    return std::string((const char*)data, (size_t)len);
+    return StringView((const char*)data, (size_t)len);
 }
 
-int64_t Buffer::read_longlong()
+template<class T>
+static T read_from_buffer(Buffer & b)
 {
-    return static_cast<int64_t>(be64toh(read_from_buffer<uint64_t>(*this)));
+    const uint8_t * data = b.read_bytes(sizeof(T));
+    if (data)
+    {
+        return *reinterpret_cast<const T*>(data);
+    }
+    return 0;
 }
 
 float   Buffer::read_float()
@@ -150,7 +164,7 @@ double  Buffer::read_double()
     return read_from_buffer<double>(*this);
 }
 
-bool Buffer::read_data(std::string & read)
+bool Buffer::read_data(StringView & read)
 {
     int32_t len = read_int();
     if (is_eof())
@@ -160,7 +174,7 @@ bool Buffer::read_data(std::string & read)
     if (data == NULL)
         return false;
 
-    read.assign((const char*)data, (size_t)len);
+    read = StringView((const char*)data, (size_t)len);
     return true;
 }
 
@@ -170,108 +184,434 @@ void Buffer::skip_data()
     skip_bytes(len);
 }
 
-const uint8_t * UncompressedBuffer::read_bytes(size_t n_bytes)
+const SharedBlock & Buffer::block_of(const uint8_t * data, size_t n_bytes) const
 {
-    if (n_bytes > buffer_len)
+    static const SharedBlock no_block;
+    return no_block;
+}
+
+bool Buffer::s_enableChecksum = true;
+bool Buffer::s_enableMapping = false;
+
+static uint32_t calculate_checksum(Buffer::ChecksumClass checksum_class, uint32_t start, const uint8_t * data, size_t len)
+{
+    return checksum_class == Buffer::CRC32 ?
+            fast_crc32(start, data, len) :
+            fast_adler32(start, data, len);
+}
+
+std::unique_ptr<Buffer> Buffer::open_file(const char * filename, bool whole_file)
+{
+    if (s_enableMapping)
+    {
+        return std::unique_ptr<Buffer>(new MappedBuffer(filename, whole_file));
+    }
+    return std::unique_ptr<Buffer>(new UncompressedBuffer(filename));
+}
+
+// Index.db is scanned entry by entry, so this is large enough to make the syscalls insignificant.
+static const size_t UNCOMPRESSED_WINDOW_SIZE = 1024 * 1024;
+
+const uint8_t * UncompressedBuffer::refill_window(size_t n_bytes)
+{
+    const int64_t position = tell();
+    if (position < window_start || position + int64_t(n_bytes) > window_start + int64_t(window_len))
+    {
+        if (position + int64_t(n_bytes) > file_size)
+        {
+            iseof = true;
+            return NULL;
+        }
+
+        if (n_bytes > window.size())
+        {
+            window.resize(n_bytes);
+        }
+
+        // Refill from the read position. Reads are sequential, so little of the old window is read again.
+        window_start = position;
+        window_len = 0;
+        while (window_len < window.size())
+        {
+            const ssize_t result = pread(fd, window.data() + window_len, window.size() - window_len, window_start + window_len);
+            if (result <= 0)
+            {
+                break;
+            }
+            window_len += result;
+        }
+
+        if (window_len < n_bytes)
+        {
+            iseof = true;
+            return NULL;
+        }
+    }
+
+    const uint8_t * start = window.data() + (position - window_start);
+    set_window(start + n_bytes, window.data() + window_len, window_start + window_len);
+    return start;
+}
+
+UncompressedBuffer::UncompressedBuffer(const char * filename) :
+    fd(-1),
+    file_size(0),
+    window_start(0),
+    window_len(0),
+    iseof(false)
+{
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
     {
-        if (buffer)
-            delete[] buffer;
-        buffer = new uint8_t[n_bytes];
-        buffer_len = n_bytes;
+        return;
     }
-    if (fread(buffer, n_bytes, 1, fp) == 0)
+
+    // Small files such as CompressionInfo.db are read in one go without a full size window.
+    struct stat file_stat;
+    file_size = fstat(fd, &file_stat) == 0 ? file_stat.st_size : INT64_MAX;
+    window.resize(size_t(std::min(file_size, int64_t(UNCOMPRESSED_WINDOW_SIZE))));
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+UncompressedBuffer::~UncompressedBuffer()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+// After the first read the window is the rest of the file, so this is only called again at the end or after a skip.
+const uint8_t * MappedBuffer::refill_window(size_t n_bytes)
+{
+    const int64_t offset = tell();
+    if (offset + n_bytes > length)
     {
         iseof = true;
         return NULL;
     }
-    return buffer;
+    const uint8_t * start = data + offset;
+    set_window(start + n_bytes, data + length, length);
+    return start;
 }
 
-void UncompressedBuffer::skip_bytes(size_t n_bytes)
+const SharedBlock & MappedBuffer::block_of(const uint8_t * bytes, size_t n_bytes) const
 {
-    fseek(fp, n_bytes, SEEK_CUR);
+    if (bytes >= data && bytes + n_bytes <= data + length && mapping)
+    {
+        return mapping;
+    }
+    return Buffer::block_of(bytes, n_bytes);
 }
 
-void UncompressedBuffer::seek(int64_t pos)
+MappedBuffer::MappedBuffer(const char * filename, bool whole_file) : data(NULL), length(0), isgood(false), iseof(false)
 {
-    iseof = fseeko(fp, pos, SEEK_SET) != 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0)
+    {
+        length = file_stat.st_size;
+        // An empty file cannot be mapped, but is still a good (empty) buffer.
+        void * mapping = length > 0 ? mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+        if (mapping != MAP_FAILED)
+        {
+            data = static_cast<const uint8_t *>(mapping);
+            isgood = true;
+            if (data != NULL)
+            {
+                madvise(mapping, length, whole_file ? MADV_WILLNEED : MADV_SEQUENTIAL);
+                // Unmapped once neither this nor any row holding values from it needs it.
+                const size_t mapped_length = length;
+                this->mapping.reset(data, [mapped_length](const uint8_t * address)
+                {
+                    munmap(const_cast<uint8_t *>(address), mapped_length);
+                });
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Cannot map %s: %s\n", filename, strerror(errno));
+        }
+    }
+    close(fd);
 }
 
-UncompressedBuffer::UncompressedBuffer(const char * filename) : fp(NULL), buffer(NULL), buffer_len(0), iseof(false)
+UncompressedDataBuffer::UncompressedDataBuffer(std::unique_ptr<Buffer> data_file, Buffer & crc_file, const char * filename,
+                                               const char * crc_filename, ChecksumClass checksum) :
+    file(std::move(data_file)),
+    length(0),
+    chunk_len(0),
+    checksum_class(checksum),
+    filename(filename),
+    isgood(false),
+    iseof(false)
 {
-    fp = fopen(filename, "r");
+    struct stat file_stat;
+    if (stat(filename, &file_stat) != 0)
+    {
+        fprintf(stderr, "Cannot stat %s: %s\n", filename, strerror(errno));
+        return;
+    }
+    length = file_stat.st_size;
+
+    chunk_len = crc_file.read_int();
+    const size_t n_chunks = chunk_len > 0 ? (length + chunk_len - 1) / chunk_len : 0;
+    // Read one at a time, so that a corrupt chunk length cannot make this allocate more than the file holds.
+    while (checksums.size() < n_chunks && !crc_file.is_eof())
+    {
+        checksums.push_back(uint32_t(crc_file.read_int()));
+    }
+    if (chunk_len <= 0 || crc_file.is_eof() || crc_file.read_bytes(1) != NULL)
+    {
+        fprintf(stderr, "%s does not match %s\n", crc_filename, filename);
+        return;
+    }
+    verified_chunks.resize(n_chunks);
+    isgood = true;
 }
 
-UncompressedBuffer::~UncompressedBuffer()
+std::shared_ptr<Buffer> UncompressedDataBuffer::open(const char * filename, const char * crc_filename, ChecksumClass checksum)
 {
-    if (fp != NULL)
+    std::unique_ptr<Buffer> file = open_file(filename, false);
+    if (!file->good() || !s_enableChecksum)
     {
-        fclose(fp);
+        return std::shared_ptr<Buffer>(std::move(file));
     }
-    if (buffer)
+
+    std::unique_ptr<Buffer> crc_file = open_file(crc_filename, true);
+    if (!crc_file->good())
     {
-        delete[] buffer;
+        fprintf(stderr, "Warning: %s has no checksums\n", filename);
+        return std::shared_ptr<Buffer>(std::move(file));
     }
+    return std::make_shared<UncompressedDataBuffer>(std::move(file), *crc_file, filename, crc_filename, checksum);
 }
 
+const uint8_t * UncompressedDataBuffer::refill_window(size_t n_bytes)
+{
+    const int64_t offset = tell();
+    const int64_t end = offset + n_bytes;
+    if (end > length)
+    {
+        iseof = true;
+        return NULL;
+    }
 
-bool CompressedBuffer::s_enableChecksum = true;
+    // Read the whole chunks holding the bytes, so that each can be checked before any of it is used.
+    const int64_t span_start = offset / chunk_len * chunk_len;
+    const int64_t span_end = std::min((std::max(end, offset + 1) + chunk_len - 1) / chunk_len * chunk_len, length);
+    file->seek(span_start);
+    const uint8_t * span = file->read_bytes(size_t(span_end - span_start));
+    if (span == NULL)
+    {
+        iseof = true;
+        return NULL;
+    }
 
-void CompressedBuffer::adjust_buffer(size_t min_length, size_t useful_bytes_in_buffer, size_t useless_bytes_in_buffer)
-{
-    if (min_length > buffer_allocation)
+    for (int64_t start_of_chunk = span_start; start_of_chunk < span_end; start_of_chunk += chunk_len)
     {
-        uint8_t * new_buffer = new uint8_t[min_length];
-        if (useful_bytes_in_buffer)
+        const size_t chunk = size_t(start_of_chunk / chunk_len);
+        if (verified_chunks[chunk])
+        {
+            continue;
+        }
+
+        const int64_t end_of_chunk = std::min(start_of_chunk + chunk_len, span_end);
+        const uint32_t calculated_checksum = calculate_checksum(checksum_class, checksum_class == ADLER32 ? 1 : 0,
+                                                                span + (start_of_chunk - span_start),
+                                                                size_t(end_of_chunk - start_of_chunk));
+        if (checksums[chunk] != calculated_checksum)
         {
-            memcpy(new_buffer, buffer + useless_bytes_in_buffer, useful_bytes_in_buffer);
+            fprintf(stderr, "Checksum mismatch at %s %lld - %lld %x %x\n", filename.c_str(),
+                    (long long)start_of_chunk, (long long)end_of_chunk, checksums[chunk], calculated_checksum);
+            exit(-1);
         }
-        if (buffer)
+        verified_chunks[chunk] = true;
+    }
+
+    // Only the checked chunks can be read without coming back here.
+    const uint8_t * start = span + (offset - span_start);
+    set_window(start + n_bytes, span + (span_end - span_start), span_end);
+    return start;
+}
+
+bool UncompressedDataBuffer::verify_digest(const char * filename, const char * crc_filename, const char * digest_filename, ChecksumClass checksum)
+{
+    if (!s_enableChecksum)
+    {
+        return true;
+    }
+
+    // The digest is the checksum in decimal.
+    FILE * digest_file = fopen(digest_filename, "r");
+    if (digest_file == NULL)
+    {
+        return true;
+    }
+    unsigned long long digest = 0;
+    const bool has_digest = fscanf(digest_file, "%llu", &digest) == 1;
+    fclose(digest_file);
+    if (!has_digest)
+    {
+        fprintf(stderr, "Cannot read digest %s\n", digest_filename);
+        return false;
+    }
+
+    struct stat data_stat;
+    std::unique_ptr<Buffer> crc_file = open_file(crc_filename, true);
+    if (!crc_file->good() || stat(filename, &data_stat) != 0)
+    {
+        return true;
+    }
+
+    const int64_t chunk_len = crc_file->read_int();
+    const int64_t length = data_stat.st_size;
+    uint32_t combined = checksum == ADLER32 ? 1 : 0;
+    for (int64_t start_of_chunk = 0; start_of_chunk < length; start_of_chunk += chunk_len)
+    {
+        const uint32_t chunk_checksum = (uint32_t)crc_file->read_int();
+        if (crc_file->is_eof())
         {
-            delete[] buffer;
+            fprintf(stderr, "%s does not match %s\n", crc_filename, filename);
+            return false;
         }
-        buffer = new_buffer;
-        buffer_allocation = min_length;
+        const int64_t len = std::min(chunk_len, length - start_of_chunk);
+        combined = checksum == CRC32 ?
+                (uint32_t)crc32_combine(combined, chunk_checksum, len) :
+                (uint32_t)adler32_combine(combined, chunk_checksum, len);
     }
-    else if (useful_bytes_in_buffer)
+
+    if (combined != uint32_t(digest))
     {
-        memmove(buffer, buffer + useless_bytes_in_buffer, useful_bytes_in_buffer);
+        fprintf(stderr, "Digest mismatch for %s %x %x\n", filename, (uint32_t)digest, combined);
+        return false;
     }
-    buffer_len = min_length;
+    return true;
 }
 
-void CompressedBuffer::decompress_block(const uint8_t * read_chunk, uint8_t * write_chunk, int chunk_size)
+ThreadPool * CompressedBuffer::s_readAheadPool = nullptr;
+size_t CompressedBuffer::s_readAheadChunks = 0;
+AsyncReader * CompressedBuffer::s_asyncReader = nullptr;
+
+// Chunks are 64KB unless the table says otherwise. Anything that does not fit is read synchronously.
+static const size_t ASYNC_BUFFER_SIZE = 256 * 1024;
+
+void CompressedBuffer::enableReadAhead(size_t n_threads, size_t n_chunks)
+{
+    // This lives until exit, as buffers may be destroyed from static destructors.
+    if (s_readAheadPool == nullptr && n_threads > 0 && n_chunks > 0)
+    {
+        s_readAheadPool = new ThreadPool(n_threads);
+        s_readAheadChunks = n_chunks;
+    }
+}
+
+void CompressedBuffer::enableAsyncIO(size_t queue_depth)
+{
+    if (s_asyncReader == nullptr && s_readAheadPool != nullptr && queue_depth > 0)
+    {
+        s_asyncReader = AsyncReader::create(queue_depth, ASYNC_BUFFER_SIZE);
+    }
+}
+
+// Per thread decompression state, as these are expensive to set up for every chunk.
+#ifdef HAVE_LIBDEFLATE
+struct DeflateContext
+{
+    DeflateContext() : decompressor(libdeflate_alloc_decompressor()) {}
+    ~DeflateContext() { libdeflate_free_decompressor(decompressor); }
+    libdeflate_decompressor * decompressor;
+};
+#else
+struct DeflateContext
+{
+    DeflateContext()
+    {
+        memset(&stream, 0, sizeof(stream));
+        inflateInit(&stream);
+    }
+    ~DeflateContext() { inflateEnd(&stream); }
+    z_stream stream;
+};
+#endif
+
+#ifdef HAVE_ZSTD
+struct ZstdContext
+{
+    ZstdContext() : context(ZSTD_createDCtx()) {}
+    ~ZstdContext() { ZSTD_freeDCtx(context); }
+    ZSTD_DCtx * context;
+};
+#endif
+
+// Returns false unless the chunk decompresses to exactly uncompressed_size bytes.
+bool CompressedBuffer::decompress_block(const uint8_t * read_chunk, uint8_t * write_chunk, int chunk_size, size_t uncompressed_size)
 {
     switch (m_compressionClass)
     {
-        case SnappyCompressor:
-            snappy::RawUncompress((const char *)read_chunk, chunk_size, (char *)write_chunk);
-            break;
+        case CompressionInfo::SnappyCompressor:
+        {
+            size_t length;
+            return snappy::GetUncompressedLength((const char *)read_chunk, chunk_size, &length) &&
+                   length == uncompressed_size &&
+                   snappy::RawUncompress((const char *)read_chunk, chunk_size, (char *)write_chunk);
+        }
 
-        case LZ4Compressor:
+        case CompressionInfo::LZ4Compressor:
         {
-            const uint32_t * block_len = (uint32_t *)(read_chunk);
-            LZ4_decompress_fast((const char *)(block_len + 1), (char *)write_chunk, *block_len);
+            // Cassandra puts the uncompressed length (little endian) in front of the block.
+            if (chunk_size < 4)
+            {
+                return false;
+            }
+            const uint32_t block_len = read_chunk[0] | read_chunk[1] << 8 | read_chunk[2] << 16 | uint32_t(read_chunk[3]) << 24;
+            return block_len == uncompressed_size &&
+                   LZ4_decompress_safe((const char *)read_chunk + 4, (char *)write_chunk, chunk_size - 4, chunk_len) == int(block_len);
         }
-            break;
 
-        case DeflateCompressor:
+        case CompressionInfo::DeflateCompressor:
         {
-            z_stream infstream;
-            memset(&infstream, 0, sizeof(infstream));
+            static thread_local DeflateContext context;
+#ifdef HAVE_LIBDEFLATE
+            size_t length;
+            return libdeflate_zlib_decompress(context.decompressor, read_chunk, chunk_size, write_chunk, chunk_len, &length) == LIBDEFLATE_SUCCESS &&
+                   length == uncompressed_size;
+#else
+            z_stream & infstream = context.stream;
+            if (inflateReset(&infstream) != Z_OK)
+            {
+                return false;
+            }
             infstream.avail_in = chunk_size;
             infstream.next_in = const_cast<uint8_t *>(read_chunk);
             infstream.avail_out = chunk_len;
             infstream.next_out = write_chunk;
-            inflateInit(&infstream);
-            inflate(&infstream, Z_NO_FLUSH);
-            inflateEnd(&infstream);
-            break;
+            return inflate(&infstream, Z_FINISH) == Z_STREAM_END && infstream.total_out == uncompressed_size;
+#endif
+        }
+
+        case CompressionInfo::ZstdCompressor:
+        {
+#ifdef HAVE_ZSTD
+            static thread_local ZstdContext context;
+            const size_t result = ZSTD_decompressDCtx(context.context, write_chunk, chunk_len, read_chunk, chunk_size);
+            return !ZSTD_isError(result) && result == uncompressed_size;
+#else
+            return false;
+#endif
         }
     }
+    return false;
 }
 
-bool CompressedBuffer::verify_checksum(const uint8_t * data, uint32_t data_len, uint8_t * checksum_data,
+bool CompressedBuffer::verify_checksum(const uint8_t * data, uint32_t data_len, const uint8_t * checksum_data,
                                        const uint64_t start_of_this_read, const uint64_t end_of_this_read)
 {
     if (!s_enableChecksum)
@@ -279,9 +619,7 @@ bool CompressedBuffer::verify_checksum(const uint8_t * data, uint32_t data_len,
         return true;
     }
 
-    const uint32_t calculated_checksum = checksum_class == CRC32 ?
-            (uint32_t)crc32(checksum_start, data, data_len) :
-            (uint32_t)adler32(checksum_start, data, data_len);
+    const uint32_t calculated_checksum = calculate_checksum(checksum_class, checksum_start, data, data_len);
 
     const uint32_t checksum = checksum_data[0] << 24 | checksum_data[1] << 16 | checksum_data[2] << 8 | checksum_data[3];
 
@@ -294,142 +632,446 @@ bool CompressedBuffer::verify_checksum(const uint8_t * data, uint32_t data_len,
     return false;
 }
 
-const uint8_t * CompressedBuffer::read_bytes(size_t n_bytes)
+// The uncompressed length of a chunk. Only the last one may be short.
+size_t CompressedBuffer::chunk_length(size_t chunk) const
 {
-    const int64_t last_byte_required = file_offset + n_bytes;
-    if (last_byte_required > uncompressed_len)
+    return (size_t)std::min(int64_t(uncompressed_len - int64_t(chunk) * chunk_len), (int64_t)chunk_len);
+}
+
+// Where chunk is stored in the data file, including its checksum.
+void CompressedBuffer::chunk_position(size_t chunk, int64_t & start_of_read, int64_t & end_of_read) const
+{
+    start_of_read = info->chunk_offset(chunk);
+    end_of_read = chunk + 1 < info->n_chunks() ? info->chunk_offset(chunk + 1) : compressed_len;
+}
+
+// Reads, verifies and decompresses a single chunk. This may be called from any thread.
+void CompressedBuffer::load_chunk(size_t chunk, uint8_t * write_chunk, std::vector<uint8_t> & compressed)
+{
+    int64_t start_of_read, end_of_read;
+    chunk_position(chunk, start_of_read, end_of_read);
+    if (mapped_data)
     {
-        iseof = true;
-        return NULL;
+        decode_chunk(chunk, mapped_data->get_data() + start_of_read, write_chunk);
+        return;
+    }
+
+    const size_t read_len = size_t(end_of_read - start_of_read);
+    if (compressed.size() < read_len)
+    {
+        compressed.resize(read_len);
+    }
+
+    pread(fd, compressed.data(), read_len, start_of_read);
+    decode_chunk(chunk, compressed.data(), write_chunk);
+}
+
+// Verifies and decompresses a chunk that has already been read. This may be called from any thread.
+void CompressedBuffer::decode_chunk(size_t chunk, const uint8_t * read_chunk, uint8_t * write_chunk)
+{
+    int64_t start_of_this_read, end_of_this_read;
+    chunk_position(chunk, start_of_this_read, end_of_this_read);
+    int chunk_size = int(end_of_this_read - start_of_this_read - 4 /* Checksum */);
+
+    if (check_before_decompression == true)
+    {
+        if (!verify_checksum(read_chunk, chunk_size, read_chunk + chunk_size, start_of_this_read, end_of_this_read))
+        {
+            exit(-1);
+        }
     }
 
-    const int64_t last_byte_in_buffer = buffer_offset + buffer_len;
-    if (file_offset < buffer_offset || last_byte_required > last_byte_in_buffer)
+    if (chunk_size >= max_compressed_len)
     {
-        size_t last_chunk = (last_byte_required + chunk_len - 1) / chunk_len;
+        memcpy(write_chunk, read_chunk, chunk_length(chunk));
+    }
+    else if (!decompress_block(read_chunk, write_chunk, chunk_size, chunk_length(chunk)))
+    {
+        fprintf(stderr, "Cannot decompress chunk at %s %lld - %lld\n", filename.c_str(), (long long)start_of_this_read, (long long)end_of_this_read);
+        exit(-1);
+    }
+
+    if (check_before_decompression == false)
+    {
+        if (!verify_checksum(write_chunk, (uint32_t)chunk_length(chunk),
+                             read_chunk + chunk_size, start_of_this_read, end_of_this_read))
+        {
+            exit(-1);
+        }
+    }
+}
+
+// Makes chunk the current chunk, waiting for read ahead to decompress it or decompressing it now.
+void CompressedBuffer::select_chunk(size_t chunk)
+{
+    ChunkSlot & slot = chunk_slots[chunk % chunk_slots.size()];
+    pthread_mutex_lock(&read_ahead_mutex);
+    // The slot may still be in use for a chunk read ahead before a seek backwards.
+    while (slot.busy)
+    {
+        pthread_cond_wait(&read_ahead_done, &read_ahead_mutex);
+    }
+    const bool loaded = slot.chunk == chunk && slot.ready;
+    slot.chunk = chunk;
+    slot.ready = false;
+    pthread_mutex_unlock(&read_ahead_mutex);
+
+    // Only this thread assigns slots, so nothing else will touch it now it is not busy.
+    if (!loaded)
+    {
+        slot.make_writable(chunk_len);
+        load_chunk(chunk, slot.data, compressed_chunk);
+    }
+    slot.ready = true;
+
+    current_slot = &slot;
+    current_data = slot.data;
+    current_start = int64_t(chunk) * chunk_len;
+    current_end = current_start + chunk_length(chunk);
+
+    schedule_read_ahead(chunk + 1);
+}
+
+// Queues the chunks following the current one to be decompressed into any slot that is free.
+// The current chunk's slot is left alone, as the reader has pointers into it.
+void CompressedBuffer::schedule_read_ahead(size_t first_chunk)
+{
+    if (s_readAheadPool == nullptr)
+    {
+        return;
+    }
 
-        size_t first_chunk_to_read = file_offset / chunk_len;
-        size_t useful_bytes_in_buffer = 0;
-        if (file_offset >= buffer_offset && file_offset <= last_byte_in_buffer)
+    std::vector<size_t> & to_submit = read_ahead_queue;
+    to_submit.clear();
+    const size_t last_chunk = std::min(first_chunk + chunk_slots.size() - 1, info->n_chunks());
+    pthread_mutex_lock(&read_ahead_mutex);
+    for (size_t chunk = first_chunk; chunk < last_chunk; chunk++)
+    {
+        ChunkSlot & slot = chunk_slots[chunk % chunk_slots.size()];
+        if (slot.chunk != chunk && !slot.busy)
         {
-            first_chunk_to_read = last_byte_in_buffer / chunk_len;
-            useful_bytes_in_buffer = last_byte_in_buffer - file_offset;
-            assert(file_offset + useful_bytes_in_buffer == first_chunk_to_read * chunk_len);
+            slot.make_writable(chunk_len);
+            slot.chunk = chunk;
+            slot.ready = false;
+            slot.busy = true;
+            read_ahead_pending++;
+            to_submit.push_back(chunk);
         }
-        size_t min_length = (last_chunk - first_chunk_to_read) * chunk_len + useful_bytes_in_buffer;
-        adjust_buffer(min_length, useful_bytes_in_buffer, buffer_len - useful_bytes_in_buffer);
+    }
+    pthread_mutex_unlock(&read_ahead_mutex);
 
-        buffer_offset = first_chunk_to_read * chunk_len - useful_bytes_in_buffer;
-        const int64_t start_of_read = offsets[first_chunk_to_read];
-        int64_t end_of_read;
-        if (last_chunk < offsets.size())
+    for (size_t chunk : to_submit)
+    {
+        if (!read_ahead_async(chunk))
         {
-            end_of_read = offsets[last_chunk];
+            s_readAheadPool->submit([this, chunk]() { read_ahead_task(chunk, nullptr); });
         }
-        else
+    }
+}
+
+// Reads the chunk with io_uring, then has it decompressed on the read ahead pool.
+bool CompressedBuffer::read_ahead_async(size_t chunk)
+{
+    if (s_asyncReader == nullptr || mapped_data)
+    {
+        return false;
+    }
+
+    int64_t start_of_read, end_of_read;
+    chunk_position(chunk, start_of_read, end_of_read);
+    const ssize_t read_len = ssize_t(end_of_read - start_of_read);
+    return s_asyncReader->read(fd, start_of_read, read_len,
+                               [this, chunk, start_of_read, read_len](const uint8_t * data, ssize_t result, size_t buffer_id)
+    {
+        if (result != read_len)
         {
-            end_of_read = lseek(fd, 0, SEEK_END);
+            fprintf(stderr, "Cannot read %zd bytes at %s %lld (%s)\n", read_len, filename.c_str(), (long long)start_of_read,
+                    result < 0 ? strerror(int(-result)) : "end of file");
+            exit(-1);
         }
 
-        const uint64_t read_len = end_of_read - start_of_read;
-        uint8_t * read_buffer = (uint8_t *)alloca(read_len);
-        pread(fd, read_buffer, read_len, start_of_read);
-        for (size_t i = first_chunk_to_read; i < last_chunk; i++)
+        // Decompressing here would leave one thread doing it for every file.
+        s_readAheadPool->submit([this, chunk, data, buffer_id]()
         {
-            const int64_t start_of_this_read = offsets[i];
-            const int64_t end_of_this_read = (i + 1 == last_chunk) ? end_of_read : offsets[i + 1];
-            int chunk_size = int(end_of_this_read - start_of_this_read - 4 /* Checksum */);
+            read_ahead_task(chunk, data);
+            s_asyncReader->release(buffer_id);
+        });
+    });
+}
 
-            const size_t buffer_read_pos = (i - first_chunk_to_read) * chunk_len + useful_bytes_in_buffer;
-            uint8_t * read_chunk = read_buffer + start_of_this_read - start_of_read;
+// read_chunk is the compressed chunk if it has already been read, otherwise it is read here.
+void CompressedBuffer::read_ahead_task(size_t chunk, const uint8_t * read_chunk)
+{
+    static thread_local std::vector<uint8_t> compressed;
+    ChunkSlot & slot = chunk_slots[chunk % chunk_slots.size()];
 
-            if (check_before_decompression == true)
-            {
-                if (!verify_checksum(read_chunk, chunk_size, read_chunk + chunk_size, start_of_this_read, end_of_this_read))
-                {
-                    exit(-1);
-                }
-            }
+    pthread_mutex_lock(&read_ahead_mutex);
+    const bool cancelled = read_ahead_cancelled;
+    pthread_mutex_unlock(&read_ahead_mutex);
+
+    // A cancelled chunk is only marked done, so that the buffer can stop waiting for it.
+    if (!cancelled)
+    {
+        if (read_chunk != nullptr)
+        {
+            decode_chunk(chunk, read_chunk, slot.data);
+        }
+        else
+        {
+            load_chunk(chunk, slot.data, compressed);
+        }
+    }
 
-            decompress_block(read_chunk, buffer + buffer_read_pos, chunk_size);
+    pthread_mutex_lock(&read_ahead_mutex);
+    slot.ready = true;
+    slot.busy = false;
+    read_ahead_pending--;
+    pthread_cond_broadcast(&read_ahead_done);
+    pthread_mutex_unlock(&read_ahead_mutex);
+}
 
-            if (check_before_decompression == false)
+const uint8_t * CompressedBuffer::refill_window(size_t n_bytes)
+{
+    const int64_t file_offset = tell();
+    const int64_t last_byte_required = file_offset + n_bytes;
+    if (last_byte_required > uncompressed_len)
+    {
+        iseof = true;
+        return NULL;
+    }
+
+    if (file_offset < current_start || last_byte_required > current_end)
+    {
+        if (n_bytes == 0)
+        {
+            static const uint8_t empty = 0;
+            return &empty;
+        }
+
+        const size_t first_chunk = file_offset / chunk_len;
+        const size_t last_chunk = (last_byte_required - 1) / chunk_len;
+        if (first_chunk == last_chunk)
+        {
+            select_chunk(first_chunk);
+        }
+        else
+        {
+            // Values that span chunks are put together in the staging buffer, which only ever grows.
+            if (staging.size() < n_bytes)
             {
-                if (!verify_checksum(buffer + buffer_read_pos,
-                                     (uint32_t)std::min(int64_t(uncompressed_len - (buffer_offset + buffer_read_pos)), (int64_t)chunk_len),
-                                     read_chunk + chunk_size, start_of_this_read, end_of_this_read))
-                {
-                    exit(-1);
-                }
+                staging.resize(n_bytes);
+            }
+            size_t copied = 0;
+            for (size_t chunk = first_chunk; chunk <= last_chunk; chunk++)
+            {
+                select_chunk(chunk);
+                const int64_t from = std::max(file_offset, current_start);
+                const int64_t to = std::min(last_byte_required, current_end);
+                memcpy(staging.data() + copied, current_data + (from - current_start), size_t(to - from));
+                copied += size_t(to - from);
             }
+            set_window(current_data + (last_byte_required - current_start), current_data + (current_end - current_start), current_end);
+            return staging.data();
         }
     }
 
-    const uint8_t * start = buffer + file_offset - buffer_offset;
-    file_offset += n_bytes;
+    // The window is the rest of the current chunk, so that most reads point straight into it.
+    const uint8_t * start = current_data + (file_offset - current_start);
+    set_window(start + n_bytes, current_data + (current_end - current_start), current_end);
     return start;
 }
 
-void CompressedBuffer::skip_bytes(size_t n_bytes)
+// Values put together in staging are not shared, as it is overwritten by the next one.
+const SharedBlock & CompressedBuffer::block_of(const uint8_t * bytes, size_t n_bytes) const
+{
+    if (current_slot != NULL && bytes >= current_data && bytes + n_bytes <= current_data + (current_end - current_start))
+    {
+        return current_slot->block;
+    }
+    return Buffer::block_of(bytes, n_bytes);
+}
+
+void CompressedBuffer::ChunkSlot::make_writable(size_t size)
+{
+    // Only the reader thread takes new references, so once this is the last one no other can appear.
+    // use_count() is a relaxed load, so the fence orders the writes that follow after the other threads' last reads,
+    // which happened before they released their references.
+    if (block.use_count() == 1)
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return;
+    }
+
+    if (block)
+    {
+        retired.push_back(std::make_pair(data, block));
+    }
+    for (std::pair<uint8_t *, SharedBlock> & spare : retired)
+    {
+        if (spare.second.use_count() == 1)
+        {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            data = spare.first;
+            block = spare.second;
+            std::swap(spare, retired.back());
+            retired.pop_back();
+            return;
+        }
+    }
+    data = new uint8_t[size];
+    block.reset(data, std::default_delete<uint8_t[]>());
+}
+
+// Blocks of chunks are as long as this allows, so long as every delta within them fits in 32 bits.
+static const int MAX_BLOCK_SHIFT = 10;
+
+std::shared_ptr<const CompressionInfo> CompressionInfo::load(const char * ci_filename, bool has_max_compressed_length)
 {
-    file_offset += n_bytes;
+    std::unique_ptr<Buffer> compression_info = Buffer::open_file(ci_filename, true);
+    if (!compression_info->good())
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<CompressionInfo> info = std::make_shared<CompressionInfo>();
+    std::string classname = compression_info->read_string();
+    if (classname == "SnappyCompressor")
+        info->compression_class = SnappyCompressor;
+    else if (classname == "LZ4Compressor")
+        info->compression_class = LZ4Compressor;
+    else if (classname == "DeflateCompressor")
+        info->compression_class = DeflateCompressor;
+#ifdef HAVE_ZSTD
+    else if (classname == "ZstdCompressor")
+        info->compression_class = ZstdCompressor;
+#endif
+    else
+    {
+        fprintf(stderr, "Unknown compression algorithm %s\n", classname.c_str());
+        return nullptr;
+    }
+
+    size_t param_count = compression_info->read_int();
+    for (size_t i = 0; i < param_count; i++)
+    {
+        compression_info->read_string();
+        compression_info->read_string();
+    }
+    info->chunk_len = compression_info->read_int();
+    info->max_compressed_len = has_max_compressed_length ? compression_info->read_int() : INT_MAX;
+    info->uncompressed_len = compression_info->read_longlong();
+
+    // The offsets are taken in one read, which the read window grows to fit when the file is not mapped, then packed.
+    const int32_t n_chunks = compression_info->read_int();
+    const uint8_t * offsets = n_chunks > 0 ? compression_info->read_bytes(size_t(n_chunks) * sizeof(int64_t)) : nullptr;
+    if (n_chunks < 0 || (n_chunks > 0 && offsets == nullptr))
+    {
+        fprintf(stderr, "%s is truncated\n", ci_filename);
+        return nullptr;
+    }
+    auto offset_at = [offsets](size_t chunk)
+    {
+        uint64_t offset;
+        memcpy(&offset, offsets + chunk * sizeof(offset), sizeof(offset));
+        return int64_t(be64toh(offset));
+    };
+
+    int64_t max_chunk_size = 0;
+    for (size_t chunk = 1; chunk < size_t(n_chunks); chunk++)
+    {
+        const int64_t chunk_size = offset_at(chunk) - offset_at(chunk - 1);
+        if (chunk_size < 0)
+        {
+            fprintf(stderr, "%s has chunks out of order\n", ci_filename);
+            return nullptr;
+        }
+        max_chunk_size = std::max(max_chunk_size, chunk_size);
+    }
+    while (info->block_shift < MAX_BLOCK_SHIFT &&
+           max_chunk_size <= int64_t(UINT32_MAX) / ((int64_t(2) << info->block_shift) - 1))
+    {
+        info->block_shift++;
+    }
+
+    info->deltas.resize(n_chunks);
+    info->block_offsets.resize((size_t(n_chunks) + (size_t(1) << info->block_shift) - 1) >> info->block_shift);
+    for (size_t chunk = 0; chunk < size_t(n_chunks); chunk++)
+    {
+        const size_t block = chunk >> info->block_shift;
+        if (chunk == block << info->block_shift)
+        {
+            info->block_offsets[block] = offset_at(chunk);
+        }
+        info->deltas[chunk] = uint32_t(offset_at(chunk) - info->block_offsets[block]);
+    }
+    return info;
 }
 
-CompressedBuffer::CompressedBuffer(const char * filename, const char * ci_filename, ChecksumClass checksum, bool checksum_compressed) :
+CompressedBuffer::CompressedBuffer(const char * filename, const std::shared_ptr<const CompressionInfo> & compression_info,
+                                   ChecksumClass checksum, bool checksum_compressed) :
     fd(-1),
     iseof(false),
-    buffer(NULL),
-    buffer_len(0),
-    buffer_allocation(0),
-    buffer_offset(0),
-    file_offset(0),
+    info(compression_info),
+    chunk_len(0),
+    max_compressed_len(INT_MAX),
+    uncompressed_len(0),
+    compressed_len(0),
+    read_ahead_pending(0),
+    read_ahead_cancelled(false),
+    current_slot(NULL),
+    current_data(NULL),
+    current_start(0),
+    current_end(0),
     checksum_class(checksum),
     check_before_decompression(checksum_compressed),
     checksum_start(checksum == ADLER32 ? (uint32_t)adler32(0L, NULL, 0) : (uint32_t)crc32(0L, NULL, 0)),
     filename(filename)
 {
-    UncompressedBuffer compression_info(ci_filename);
-    if (compression_info.good())
+    pthread_mutex_init(&read_ahead_mutex, nullptr);
+    pthread_cond_init(&read_ahead_done, nullptr);
+
+    if (info)
     {
-        std::string classname = compression_info.read_string();
-        if (classname == "SnappyCompressor")
-            m_compressionClass = SnappyCompressor;
-        else if (classname == "LZ4Compressor")
-            m_compressionClass = LZ4Compressor;
-        else if (classname == "DeflateCompressor")
-            m_compressionClass = DeflateCompressor;
-        else
-        {
-            fprintf(stderr, "Unknown compression algorithm %s\n", classname.c_str());
-            return;
-        }
+        m_compressionClass = info->compression_class;
+        chunk_len = info->chunk_len;
+        max_compressed_len = info->max_compressed_len;
+        uncompressed_len = info->uncompressed_len;
 
-        size_t param_count = compression_info.read_int();
-        for (size_t i = 0; i < param_count; i++)
+        fd = open(filename, O_RDONLY);
+        compressed_len = lseek(fd, 0, SEEK_END);
+        if (s_enableMapping)
         {
-            compression_info.read_string();
-            compression_info.read_string();
+            mapped_data.reset(new MappedBuffer(filename, false));
+            if (!mapped_data->good() || int64_t(mapped_data->size()) != compressed_len)
+            {
+                mapped_data.reset();
+            }
         }
-        chunk_len = compression_info.read_int();
-        uncompressed_len = compression_info.read_longlong();
 
-        offsets.resize(compression_info.read_int());
-        for (size_t i = 0; i < offsets.size(); i++)
+        // One slot for the current chunk, and the rest for the chunks being read ahead.
+        const size_t n_slots = s_readAheadPool != nullptr ? s_readAheadChunks + 1 : 1;
+        chunk_slots.resize(std::max(std::min(n_slots, info->n_chunks()), size_t(1)));
+        for (ChunkSlot & slot : chunk_slots)
         {
-            offsets[i] = compression_info.read_longlong();
+            slot.make_writable(chunk_len);
         }
-
-        fd = open(filename, O_RDONLY);
     }
 }
 
 CompressedBuffer::~CompressedBuffer()
 {
-    close(fd);
-    if (buffer)
+    // Chunks still queued will see this and do nothing, but any being decompressed must finish first.
+    pthread_mutex_lock(&read_ahead_mutex);
+    read_ahead_cancelled = true;
+    while (read_ahead_pending > 0)
     {
-        delete[] buffer;
+        pthread_cond_wait(&read_ahead_done, &read_ahead_mutex);
     }
+    pthread_mutex_unlock(&read_ahead_mutex);
+    pthread_cond_destroy(&read_ahead_done);
+    pthread_mutex_destroy(&read_ahead_mutex);
+
+    close(fd);
 }
 
 bool CompressedBuffer::good() const
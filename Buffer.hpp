@@ -18,75 +18,360 @@
 #ifndef __BUFFER_H__
 #define __BUFFER_H__
 
+#include "StringView.hpp"
+
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <memory>
 #include <string>
 #include <vector>
 
+class AsyncReader;
+class ThreadPool;
+
+// Memory that a buffer hands out pointers into. Holding a reference keeps it valid after the buffer moves on.
+typedef std::shared_ptr<const uint8_t> SharedBlock;
+
 class Buffer
 {
 protected:
-    ~Buffer() {}
+    static bool s_enableChecksum;
+    static bool s_enableMapping;
+
+    // Reads that fit in [m_cursor, m_limit) are served inline, and only the rest reach the subclass through
+    // refill_window(). m_limit_position is the offset of m_limit in the file, so the read position is always known.
+    const uint8_t * m_cursor;
+    const uint8_t * m_limit;
+    int64_t m_limit_position;
+
+    int64_t tell() const
+    {
+        return m_limit_position - (m_limit - m_cursor);
+    }
+    void set_window(const uint8_t * cursor, const uint8_t * limit, int64_t limit_position)
+    {
+        m_cursor = cursor;
+        m_limit = limit;
+        m_limit_position = limit_position;
+    }
+    // Empties the window, so that the next read goes to refill_window().
+    void set_position(int64_t position)
+    {
+        set_window(NULL, NULL, position);
+    }
+    // Returns n_bytes from tell() (or NULL at the end of the file) and sets the window to what follows them.
+    virtual const uint8_t * refill_window(size_t n_bytes) = 0;
+    uint64_t read_unsigned_vint_slow();
+
+    // The shifts compile to a single load and byte swap.
+    static uint64_t load_big_endian64(const uint8_t * data)
+    {
+        return uint64_t(data[0]) << 56 | uint64_t(data[1]) << 48 | uint64_t(data[2]) << 40 | uint64_t(data[3]) << 32 |
+               uint64_t(data[4]) << 24 | uint64_t(data[5]) << 16 | uint64_t(data[6]) << 8 | uint64_t(data[7]);
+    }
+
+    // The number of leading ones in the first byte is the number of bytes that follow it, and the rest of its bits
+    // are the top of the value. data must have at least 9 bytes readable.
+    static uint64_t decode_unsigned_vint(const uint8_t *& data)
+    {
+        const uint8_t first_byte = *data;
+        if (first_byte < 0x80)
+        {
+            data++;
+            return first_byte;
+        }
+
+        const int extra_bytes = __builtin_clz(~(uint32_t(first_byte) << 24));
+        const uint64_t value = extra_bytes == 8 ?
+                load_big_endian64(data + 1) :
+                (load_big_endian64(data) >> (56 - 8 * extra_bytes)) & ((uint64_t(1) << (7 * extra_bytes + 7)) - 1);
+        data += extra_bytes + 1;
+        return value;
+    }
 
 public:
-    virtual const uint8_t * read_bytes(size_t n_bytes) = 0;
-    virtual void skip_bytes(size_t n_bytes) = 0;
+    enum ChecksumClass
+    {
+        ADLER32,
+        CRC32,
+        NONE
+    };
+
+    Buffer() : m_cursor(NULL), m_limit(NULL), m_limit_position(0) {}
+    virtual ~Buffer() {}
+
+    static void enableChecksum(bool enabled)
+    {
+        s_enableChecksum = enabled;
+    }
+    static bool isChecksumEnabled()
+    {
+        return s_enableChecksum;
+    }
+
+    // Memory map files rather than reading them through stdio or pread.
+    static void enableMapping(bool enabled)
+    {
+        s_enableMapping = enabled;
+    }
+    // Opens an uncompressed file. whole_file says that it is small enough to read in its entirety.
+    static std::unique_ptr<Buffer> open_file(const char * filename, bool whole_file);
+
+    // The comparison is strict so that an empty window, including the initial one, always takes the slow path.
+    const uint8_t * read_bytes(size_t n_bytes)
+    {
+        if (n_bytes < size_t(m_limit - m_cursor))
+        {
+            const uint8_t * start = m_cursor;
+            m_cursor += n_bytes;
+            return start;
+        }
+        return refill_window(n_bytes);
+    }
+    void skip_bytes(size_t n_bytes)
+    {
+        if (n_bytes < size_t(m_limit - m_cursor))
+        {
+            m_cursor += n_bytes;
+        }
+        else
+        {
+            set_position(tell() + n_bytes);
+        }
+    }
     virtual void seek(int64_t position) = 0;
     virtual bool is_eof() const = 0;
     virtual bool good() const = 0;
-    int32_t read_int();
+    // The block holding n_bytes at data, if they came from the last read and the buffer can share them.
+    // Otherwise (they were copied into a window that will be reused) the result is empty.
+    virtual const SharedBlock & block_of(const uint8_t * data, size_t n_bytes) const;
+    int32_t read_int()
+    {
+        const uint8_t * data = read_bytes(4);
+        if (data == NULL)
+        {
+            return 0;
+        }
+        return static_cast<int32_t>(uint32_t(data[0]) << 24 | uint32_t(data[1]) << 16 | uint32_t(data[2]) << 8 | data[3]);
+    }
     int64_t read_vint();
-    uint64_t read_unsigned_vint();
-    int16_t read_short();
-    uint8_t read_byte();
-    int64_t read_longlong();
+    uint64_t read_unsigned_vint()
+    {
+        if (size_t(m_limit - m_cursor) >= 9)
+        {
+            return decode_unsigned_vint(m_cursor);
+        }
+        return read_unsigned_vint_slow();
+    }
+    // Reads count consecutive vints into values.
+    void read_unsigned_vints(uint64_t * values, size_t count);
+    int16_t read_short()
+    {
+        const uint8_t * data = read_bytes(2);
+        if (data == NULL)
+        {
+            return 0;
+        }
+        return static_cast<int16_t>(data[0] << 8 | data[1]);
+    }
+    uint8_t read_byte()
+    {
+        return *read_bytes(1);
+    }
+    int64_t read_longlong()
+    {
+        const uint8_t * data = read_bytes(8);
+        if (data == NULL)
+        {
+            return 0;
+        }
+        return static_cast<int64_t>(load_big_endian64(data));
+    }
     float   read_float();
     double  read_double();
-    std::string read_string();
-    std::string read_vint_length_string();
-    bool    read_data(std::string & read);
+    // The views are only valid until the next read.
+    StringView read_string_view();
+    StringView read_vint_length_string_view();
+    bool    read_data(StringView & read);
+    std::string read_string()
+    {
+        return read_string_view().to_string();
+    }
+    std::string read_vint_length_string()
+    {
+        return read_vint_length_string_view().to_string();
+    }
+    bool    read_data(std::string & read)
+    {
+        StringView view;
+        if (!read_data(view))
+        {
+            return false;
+        }
+        read.assign(view.data(), view.size());
+        return true;
+    }
     void    skip_data();
 };
 
-class UncompressedBuffer : public Buffer
+// Reads whole blocks of the file at a time, so that most reads and skips are served from memory.
+class UncompressedBuffer final : public Buffer
 {
 protected:
-    FILE * fp;
-    uint8_t * buffer;
-    size_t buffer_len;
+    int fd;
+    int64_t file_size;
+    std::vector<uint8_t> window;
+    int64_t window_start;
+    size_t window_len;
     bool iseof;
     UncompressedBuffer(const UncompressedBuffer & other) = delete;
     UncompressedBuffer operator=(const UncompressedBuffer & other) = delete;
+    virtual const uint8_t * refill_window(size_t n_bytes) override;
 public:
-    virtual const uint8_t * read_bytes(size_t n_bytes) override;
-    virtual void skip_bytes(size_t n_bytes) override;
-    virtual void seek(int64_t position) override;
+    virtual void seek(int64_t position) override
+    {
+        set_position(position);
+        iseof = false;
+    }
     virtual bool is_eof() const override
     {
         return iseof;
     }
     virtual bool good() const override
     {
-        return fp != NULL;
+        return fd >= 0;
     }
     UncompressedBuffer(const char * filename);
     ~UncompressedBuffer();
 };
 
-class CompressedBuffer : public Buffer
+// Reads return pointers straight into the mapping, which remain valid for the life of the buffer.
+class MappedBuffer : public Buffer
 {
-    CompressedBuffer(const CompressedBuffer & other) = delete;
-    CompressedBuffer operator=(const CompressedBuffer & other) = delete;
+protected:
+    SharedBlock mapping;
+    const uint8_t * data;
+    size_t length;
+    bool isgood;
+    bool iseof;
+    MappedBuffer(const MappedBuffer & other) = delete;
+    MappedBuffer operator=(const MappedBuffer & other) = delete;
+    virtual const uint8_t * refill_window(size_t n_bytes) override;
 public:
-    enum ChecksumClass
+    virtual void seek(int64_t position) override
     {
-        ADLER32,
-        CRC32,
-        NONE
+        set_position(position);
+        iseof = position > int64_t(length);
+    }
+    virtual bool is_eof() const override
+    {
+        return iseof;
+    }
+    virtual bool good() const override
+    {
+        return isgood;
+    }
+    virtual const SharedBlock & block_of(const uint8_t * bytes, size_t n_bytes) const override;
+    const uint8_t * get_data() const
+    {
+        return data;
+    }
+    size_t size() const
+    {
+        return length;
+    }
+    MappedBuffer(const char * filename, bool whole_file);
+};
+
+// An uncompressed Data.db, read through open_file(). Each chunk is checked against -CRC.db the first time any of it is
+// read, so reads are served a whole chunk at a time.
+class UncompressedDataBuffer final : public Buffer
+{
+protected:
+    std::unique_ptr<Buffer> file;
+    int64_t length;
+    int64_t chunk_len;
+    const ChecksumClass checksum_class;
+    const std::string filename;
+    std::vector<uint32_t> checksums;
+    std::vector<bool> verified_chunks;
+    bool isgood;
+    bool iseof;
+    virtual const uint8_t * refill_window(size_t n_bytes) override;
+public:
+    virtual void seek(int64_t position) override
+    {
+        set_position(position);
+        iseof = false;
+    }
+    virtual bool is_eof() const override
+    {
+        return iseof;
+    }
+    virtual bool good() const override
+    {
+        return isgood;
+    }
+    virtual const SharedBlock & block_of(const uint8_t * bytes, size_t n_bytes) const override
+    {
+        return file->block_of(bytes, n_bytes);
+    }
+    UncompressedDataBuffer(std::unique_ptr<Buffer> file, Buffer & crc_file, const char * filename, const char * crc_filename,
+                           ChecksumClass checksum);
+
+    // Without checksums, or without -CRC.db, this is just the file from open_file().
+    static std::shared_ptr<Buffer> open(const char * filename, const char * crc_filename, ChecksumClass checksum);
+    // -CRC.db holds a checksum for each chunk, which are combined and compared to the digest of the whole file.
+    // Returns true if they match, or if there is no digest to compare with.
+    static bool verify_digest(const char * filename, const char * crc_filename, const char * digest_filename, ChecksumClass checksum);
+};
+
+// What -CompressionInfo.db says about a compressed Data.db. It never changes, so it is read once per table and shared by
+// every buffer opened on the table.
+// A large table has millions of chunks, so rather than a 64 bit offset for each, there is one for each block of chunks
+// and each chunk is a 32 bit delta from the start of its block.
+class CompressionInfo
+{
+    std::vector<int64_t> block_offsets;
+    std::vector<uint32_t> deltas;
+    int block_shift;
+public:
+    enum CompressionClass
+    {
+        LZ4Compressor,
+        SnappyCompressor,
+        DeflateCompressor,
+        ZstdCompressor
     };
 
-    virtual const uint8_t * read_bytes(size_t n_bytes) override;
-    virtual void skip_bytes(size_t n_bytes) override;
+    CompressionInfo() : block_shift(0), compression_class(LZ4Compressor), chunk_len(0), max_compressed_len(0), uncompressed_len(0) {}
+
+    // From Cassandra 4.0 (na), CompressionInfo records a maximum compressed length. Chunks at least that long are stored as is.
+    // Returns null if the file cannot be read.
+    static std::shared_ptr<const CompressionInfo> load(const char * ci_filename, bool has_max_compressed_length);
+
+    size_t n_chunks() const
+    {
+        return deltas.size();
+    }
+    // Where chunk starts in Data.db.
+    int64_t chunk_offset(size_t chunk) const
+    {
+        return block_offsets[chunk >> block_shift] + deltas[chunk];
+    }
+
+    CompressionClass compression_class;
+    int32_t chunk_len;
+    int32_t max_compressed_len;
+    int64_t uncompressed_len;
+};
+
+class CompressedBuffer final : public Buffer
+{
+    CompressedBuffer(const CompressedBuffer & other) = delete;
+    CompressedBuffer operator=(const CompressedBuffer & other) = delete;
+public:
     virtual bool good() const override;
     virtual bool is_eof() const override
     {
@@ -94,45 +379,82 @@ public:
     }
     virtual void seek(int64_t position) override
     {
-        file_offset = position;
+        set_position(position);
     }
+    virtual const SharedBlock & block_of(const uint8_t * bytes, size_t n_bytes) const override;
 
-    CompressedBuffer(const char * filename, const char * ci_filename, ChecksumClass adler, bool checksumCompressed);
+    // info is null if CompressionInfo.db could not be read, in which case the buffer is not good.
+    CompressedBuffer(const char * filename, const std::shared_ptr<const CompressionInfo> & compression_info, ChecksumClass adler, bool checksumCompressed);
     ~CompressedBuffer();
 
-    static void enableChecksum(bool enabled)
+    // Decompress up to n_chunks ahead of the reader on a pool of n_threads.
+    static void enableReadAhead(size_t n_threads, size_t n_chunks);
+    // Read ahead with io_uring, keeping up to queue_depth reads in flight across every buffer. Requires read ahead.
+    static void enableAsyncIO(size_t queue_depth);
+    static AsyncReader * getAsyncReader()
     {
-        s_enableChecksum = enabled;
+        return s_asyncReader;
     }
 protected:
-    static bool s_enableChecksum;
+    static ThreadPool * s_readAheadPool;
+    static size_t s_readAheadChunks;
+    static AsyncReader * s_asyncReader;
 
     int fd;
+    std::unique_ptr<MappedBuffer> mapped_data;
     bool iseof;
+    const std::shared_ptr<const CompressionInfo> info;
+    // Copied from info, as they are needed for every chunk.
     int32_t chunk_len;
+    int32_t max_compressed_len;
     int64_t uncompressed_len;
-    std::vector<int64_t> offsets;
+    int64_t compressed_len;
+    std::vector<uint8_t> compressed_chunk;
 
-    uint8_t * buffer;
-    size_t buffer_len;
-    size_t buffer_allocation;
-    int64_t buffer_offset;
-    int64_t file_offset;
+    // Chunk n is decompressed into slot n % chunk_slots.size(), either when it is read or ahead of time.
+    struct ChunkSlot
+    {
+        ChunkSlot() : data(NULL), chunk(SIZE_MAX), ready(false), busy(false) {}
+        // Rows may still hold the block after the slot moves on, in which case it is given a new one to fill.
+        void make_writable(size_t size);
+        uint8_t * data;
+        SharedBlock block;
+        // Blocks given up while rows held them, to be used again once the rows let go.
+        std::vector<std::pair<uint8_t *, SharedBlock>> retired;
+        size_t chunk;
+        bool ready;
+        bool busy;
+    };
+    std::vector<ChunkSlot> chunk_slots;
+    std::vector<size_t> read_ahead_queue;
+    size_t read_ahead_pending;
+    bool read_ahead_cancelled;
+    pthread_mutex_t read_ahead_mutex;
+    pthread_cond_t read_ahead_done;
+
+    // The slot that reads are being served from.
+    const ChunkSlot * current_slot;
+    const uint8_t * current_data;
+    int64_t current_start;
+    int64_t current_end;
+    std::vector<uint8_t> staging;
     const ChecksumClass checksum_class;
     const bool check_before_decompression;
     const uint32_t checksum_start;
     const std::string filename;
 
-    enum CompressionClass
-    {
-        LZ4Compressor,
-        SnappyCompressor,
-        DeflateCompressor
-    };
-    CompressionClass m_compressionClass;
-    void adjust_buffer(size_t min_length, size_t useful_bytes_in_buffer, size_t useless_bytes_in_buffer);
-    void decompress_block(const uint8_t * read_chunk, uint8_t * write_chunk, int chunk_size);
-    bool verify_checksum(const uint8_t * data, uint32_t data_len, uint8_t * checksum_data,
+    CompressionInfo::CompressionClass m_compressionClass;
+    size_t chunk_length(size_t chunk) const;
+    void chunk_position(size_t chunk, int64_t & start_of_read, int64_t & end_of_read) const;
+    void load_chunk(size_t chunk, uint8_t * write_chunk, std::vector<uint8_t> & compressed);
+    void decode_chunk(size_t chunk, const uint8_t * read_chunk, uint8_t * write_chunk);
+    void select_chunk(size_t chunk);
+    virtual const uint8_t * refill_window(size_t n_bytes) override;
+    void schedule_read_ahead(size_t first_chunk);
+    bool read_ahead_async(size_t chunk);
+    void read_ahead_task(size_t chunk, const uint8_t * read_chunk);
+    bool decompress_block(const uint8_t * read_chunk, uint8_t * write_chunk, int chunk_size, size_t uncompressed_size);
+    bool verify_checksum(const uint8_t * data, uint32_t data_len, const uint8_t * checksum_data,
                          const uint64_t start_of_this_read, const uint64_t end_of_this_read);
 };
 
@@ -16,8 +16,11 @@
 //  Iterate through a cassandra table and write the contents to Aerospike
 
 #include "AerospikeWriter.hpp"
+#include "AsyncReader.hpp"
 #include "CassandraParser.hpp"
 #include "DryRun.hpp"
+#include "MetadataCache.hpp"
+#include "TokenRanges.hpp"
 #include "Utilities.hpp"
 
 #include <assert.h>
@@ -48,7 +51,14 @@ static void print_usage(const char * name)
             "    [-t <aerospike table name>] If absent, the table name will be deduced from the cassandra directory.\n"
             "    [-n <aerospike namespace>]   If absent, the keyspace name will be deduced from the cassandra directory.\n"
             "    [-C]                        Disable checksum (default enabled)\n"
+            "    [-M]                        Memory map SSTable files rather than reading them (default disabled)\n"
+            "    [-c <cache directory>]      Keep each SSTable's metadata here, so that later runs over the same files start faster\n"
+            "    [-d <number of decompression threads> (default 0, decompress on the parser threads)]\n"
+            "    [-w <number of chunks to decompress ahead per SSTable> (default 8, requires -d)]\n"
+            "    [-U <number of reads in flight>] Read ahead using io_uring (default off, requires -d)\n"
             "    [-e <number of event threads> (default 4)]\n"
+            "    [-P <number of parser threads> (default is the number of event threads)]\n"
+            "    [-r <number of token ranges per parser thread> (default 16)]\n"
             "    [-a <max asynchronous operations in flight per thread> (default 100)]\n"
             "    [-s key value to start processing]\n"
             "    [-S key value to start processing (represented in hexedecimal)\n"
@@ -62,22 +72,36 @@ static void print_usage(const char * name)
 }
 
 
-static int do_live_run(as_config & as, CassandraParser::iterator & iter, unsigned int numEventLoops,
+static int do_live_run(as_config & as, TokenRangeScheduler & scheduler, unsigned int numEventLoops, unsigned int numParserThreads,
                        const std::string & keyspace, const std::string & tableName);
 
-static int do_transfer(aerospike & as, CassandraParser::iterator & iter, unsigned int numEventLoops,
+static int do_transfer(aerospike & as, TokenRangeScheduler & scheduler, unsigned int numEventLoops, unsigned int numParserThreads,
                        const std::string & keyspace, const std::string & tableName);
 
 static void wait_for_writers(std::vector<AerospikeWriter> & writers, pthread_mutex_t * status_lock, pthread_cond_t * check_status);
 
+static void print_io_statistics(FILE * out)
+{
+    if (AsyncReader * reader = CompressedBuffer::getAsyncReader())
+    {
+        AsyncReader::Statistics statistics = reader->get_statistics();
+        fprintf(out, "Read %llu chunks with io_uring at %.1f MB/s, average queue depth %.1f\n",
+                (unsigned long long)statistics.reads, statistics.bytes_per_second / (1024 * 1024), statistics.average_queue_depth);
+    }
+}
+
 static int parse_arguments(int argc, char * argv[],
-                           as_config & config, unsigned int & numEventLoops, std::vector<std::string> & paths, bool & dry_run,
+                           as_config & config, unsigned int & numEventLoops, unsigned int & numParserThreads, unsigned int & rangesPerThread,
+                           std::vector<std::string> & paths, bool & dry_run,
                            std::string & set_name, std::string & name_space, const char *& firstKey)
 {
     const char * user = NULL;
     const char * password = NULL;
+    unsigned int decompressionThreads = 0;
+    unsigned int readAheadChunks = 8;
+    unsigned int asyncQueueDepth = 0;
     int opt;
-    while ((opt = getopt(argc, argv, "i:t:n:h:Ca:e:Vs:S:L:xfu:p:D")) != -1)
+    while ((opt = getopt(argc, argv, "i:t:n:h:CMc:d:w:U:a:e:P:r:Vs:S:L:xfu:p:D")) != -1)
     {
         switch (opt) {
             case 'i':
@@ -111,6 +135,26 @@ static int parse_arguments(int argc, char * argv[],
                 CompressedBuffer::enableChecksum(false);
                 break;
 
+            case 'M':
+                Buffer::enableMapping(true);
+                break;
+
+            case 'c':
+                MetadataCache::set_directory(optarg);
+                break;
+
+            case 'd':
+                decompressionThreads = atoi(optarg);
+                break;
+
+            case 'w':
+                readAheadChunks = atoi(optarg);
+                break;
+
+            case 'U':
+                asyncQueueDepth = atoi(optarg);
+                break;
+
             case 'a':
                 AerospikeWriter::set_max_records_in_flight(atoi(optarg));
                 break;
@@ -119,6 +163,14 @@ static int parse_arguments(int argc, char * argv[],
                 numEventLoops = atoi(optarg);
                 break;
 
+            case 'P':
+                numParserThreads = atoi(optarg);
+                break;
+
+            case 'r':
+                rangesPerThread = atoi(optarg);
+                break;
+
             case 's':
                 firstKey = optarg;
                 break;
@@ -197,6 +249,15 @@ static int parse_arguments(int argc, char * argv[],
         return -1;
     }
 
+    CompressedBuffer::enableReadAhead(decompressionThreads, readAheadChunks);
+
+    if (asyncQueueDepth > 0 && decompressionThreads == 0)
+    {
+        fprintf(stderr, "Invalid arguments: -U requires -d\n");
+        return -1;
+    }
+    CompressedBuffer::enableAsyncIO(asyncQueueDepth);
+
     if ((user == nullptr) != (password == nullptr))
     {
         fprintf(stderr, "Invalid arguments: %s\n",
@@ -233,6 +294,8 @@ static int parse_arguments(int argc, char * argv[],
 int main(int argc, char * argv[])
 {
     unsigned int numEventLoops = 4;
+    unsigned int numParserThreads = 0;
+    unsigned int rangesPerThread = 16;
 
     std::vector<std::string> paths;
     const char * firstKey = NULL;
@@ -246,7 +309,7 @@ int main(int argc, char * argv[])
     config.policies.write.base.max_retries = 14; // Maximum number of retries when a transaction fails due to a network error.
     config.policies.write.base.total_timeout = 1500;
 
-    if (parse_arguments(argc, argv, config, numEventLoops, paths, dry_run, set_name, name_space, firstKey))
+    if (parse_arguments(argc, argv, config, numEventLoops, numParserThreads, rangesPerThread, paths, dry_run, set_name, name_space, firstKey))
     {
         print_usage(argv[0]);
         return -1;
@@ -292,19 +355,25 @@ int main(int argc, char * argv[])
     }
 
 
-    CassandraParser::iterator iter = firstKey == NULL ? parser.begin() : parser.find(firstKey);
     if (dry_run)
     {
+        CassandraParser::iterator iter = firstKey == NULL ? parser.begin() : parser.find(firstKey);
         do_dry_run(iter);
+        print_io_statistics(stderr);
         return 0;
     }
     else
     {
-        return do_live_run(config, iter, numEventLoops, name_space, set_name);
+        if (numParserThreads == 0)
+        {
+            numParserThreads = numEventLoops;
+        }
+        TokenRangeScheduler scheduler(parser, numParserThreads * rangesPerThread, firstKey);
+        return do_live_run(config, scheduler, numEventLoops, numParserThreads, name_space, set_name);
     }
 }
 
-static int do_live_run(as_config & config, CassandraParser::iterator & iter, unsigned int numEventLoops,
+static int do_live_run(as_config & config, TokenRangeScheduler & scheduler, unsigned int numEventLoops, unsigned int numParserThreads,
                        const std::string & name_space, const std::string & set_name)
 {
     as_event_loop * loops = as_event_create_loops(numEventLoops);
@@ -322,7 +391,7 @@ static int do_live_run(as_config & config, CassandraParser::iterator & iter, uns
     int return_code = -1;
     if (aerospike* as = aerospike_new(&config))
     {
-        return_code = do_transfer(*as, iter, numEventLoops, name_space, set_name);
+        return_code = do_transfer(*as, scheduler, numEventLoops, numParserThreads, name_space, set_name);
         aerospike_destroy(as);
     }
     else
@@ -334,7 +403,7 @@ static int do_live_run(as_config & config, CassandraParser::iterator & iter, uns
     return return_code;
 }
 
-static int do_transfer(aerospike & as, CassandraParser::iterator & iter, unsigned int numEventLoops,
+static int do_transfer(aerospike & as, TokenRangeScheduler & scheduler, unsigned int numEventLoops, unsigned int numParserThreads,
                        const std::string & keyspace, const std::string & tableName)
 {
     as_error err;
@@ -344,34 +413,40 @@ static int do_transfer(aerospike & as, CassandraParser::iterator & iter, unsigne
         return -1;
     }
 
-    pthread_mutex_t iterator_mutex;
-    // Only use a mutex if there is more than one thread.
-    pthread_mutex_t * iterator_mutex_ptr = numEventLoops > 1 ? &iterator_mutex : nullptr;
     pthread_mutex_t status_lock;
     pthread_cond_t check_status;
 
     if (pthread_mutex_init(&status_lock, nullptr) != 0 ||
-        pthread_cond_init(&check_status, nullptr) != 0 ||
-        (iterator_mutex_ptr != nullptr && pthread_mutex_init(iterator_mutex_ptr, nullptr) != 0))
+        pthread_cond_init(&check_status, nullptr) != 0)
     {
         fprintf(stderr, "ERROR: cannot init mutex %d\n", errno);
         aerospike_close(&as, &err);
         return -1;
     }
 
+    // Enough rows to fill every writer's pipeline twice over.
+    RowProducer producer(scheduler, numParserThreads, numEventLoops * AerospikeWriter::get_max_records_in_flight() * 2);
+
     std::vector<AerospikeWriter> writers;
     writers.reserve(numEventLoops);
     for (unsigned int i = 0; i < numEventLoops; i++)
     {
-        writers.emplace_back(iter, as, keyspace.c_str(), tableName.c_str(), iterator_mutex_ptr, &status_lock, &check_status);
+        writers.emplace_back(producer, i, as, keyspace.c_str(), tableName.c_str(), &status_lock, &check_status);
+    }
+
+    if (!producer.start(writers))
+    {
+        AerospikeWriter::terminate();
     }
 
-    for (unsigned int index = 0; index < writers.size(); index++)
+    for (AerospikeWriter & writer : writers)
     {
-        writers[index].write_next(as_event_loop_get_by_index(index));
+        writer.resume();
     }
 
     wait_for_writers(writers, &status_lock, &check_status);
+    producer.join();
+    producer.collect_unsent_rows();
 
     size_t total_existing = 0;
     size_t total_failed = 0;
@@ -384,10 +459,10 @@ static int do_transfer(aerospike & as, CassandraParser::iterator & iter, unsigne
     }
 
     printf("Exported %lu records, failed to write %zu records, skipped %lu deleted/expired records, skipped %lu records that were already in Aerospike.\n",
-           iter.getCassandraReadRecords() - total_existing - total_failed - total_expired, total_failed, iter.getSkippedRecords() + total_expired, total_existing);
+           scheduler.getCassandraReadRecords() - producer.get_unsent_count() - total_existing - total_failed - total_expired,
+           total_failed, scheduler.getSkippedRecords() + total_expired, total_existing);
     std::string first_unsent;
-    if (AerospikeWriter::get_first_unsent_record(first_unsent, writers) ||
-        iter.get_next_key(first_unsent))
+    if (AerospikeWriter::get_first_unsent_record(first_unsent, writers, producer, scheduler))
     {
         bool printable = isPrintable(first_unsent);
         std::string as_hex = binaryToHex(first_unsent);
@@ -399,16 +474,11 @@ static int do_transfer(aerospike & as, CassandraParser::iterator & iter, unsigne
     {
         printf("Export complete\n");
     }
+    print_io_statistics(stdout);
 
     aerospike_close(&as, &err);
 
     // These mutexes must be destroyed after aerospike has been shut down.
-    if (iterator_mutex_ptr)
-    {
-        pthread_mutex_destroy(iterator_mutex_ptr);
-        iterator_mutex_ptr = nullptr;
-    }
-
     pthread_mutex_destroy(&status_lock);
     pthread_cond_destroy(&check_status);
 
@@ -455,7 +525,7 @@ static void wait_for_writers(std::vector<AerospikeWriter> & writers, pthread_mut
         usleep(150000);
         for (size_t index : stalled_indexes)
         {
-            writers[index].write_next(as_event_loop_get_by_index(index));
+            writers[index].resume();
         }
     }
 }
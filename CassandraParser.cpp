@@ -19,12 +19,13 @@
 #include "Buffer.hpp"
 #include "Partitioners.hpp"
 #include "SSTable.hpp"
+#include "ThreadPool.hpp"
 
 #include <algorithm>
 #include <climits>
 #include <cstring>
+#include <functional>
 #include <iostream>
-#include <map>
 
 #include <assert.h>
 #include <dirent.h>
@@ -34,49 +35,145 @@
 const char DATA_SUFFIX[] = "-Data.db";
 const char STATISTICS_SUFFIX[] = "-Statistics.db";
 const size_t DATA_SUFFIX_LEN = sizeof(DATA_SUFFIX) - 1;
+// Tables are only loaded in parallel if there are enough of them to keep each thread busy.
+const size_t TABLES_PER_THREAD = 16;
+const size_t MAX_TABLE_THREADS = 16;
 
 bool CassandraParser::Sorter::operator()(const SStable & a, const SStable & b)
 {
-    return m_partitioner.compare_token(a.next_token(), a.next_key(), b.next_token(), b.next_key()) < 0;
+    return Partitioner::compare_token(a.next_token(), a.next_key(), b.next_token(), b.next_key()) < 0;
 }
 
 bool CassandraParser::Sorter::operator()(const std::unique_ptr<SStable> & a, const std::unique_ptr<SStable> & b)
 {
-    return m_partitioner.compare_token(a->next_token(), a->next_key(), b->next_token(), b->next_key()) < 0;
+    return Partitioner::compare_token(a->next_token(), a->next_key(), b->next_token(), b->next_key()) < 0;
 }
 
-// Adds a filename to the set of files associated with this parser.
-bool CassandraParser::add_data_file(const std::string & dir_string, const char * name, size_t namelen)
+// Calls task(index) for every index below n. With enough of them, they are shared among a few threads, as each
+// usually has to wait on opening files.
+static void for_each_index(size_t n, const std::function<void(size_t)> & task)
 {
-    const int version = SStable::getVersionFromFilename(name);
-    if (version < 0)
+    const size_t n_threads = std::min(n / TABLES_PER_THREAD, MAX_TABLE_THREADS);
+    if (n_threads > 1)
     {
-        fprintf(stderr, "Tables file name %s does not seem to have a version number in the right place\n", name);
+        // The pool runs every task before it is destroyed.
+        ThreadPool pool(n_threads);
+        for (size_t index = 0; index < n; index++)
+        {
+            pool.submit([&task, index]() { task(index); });
+        }
+    }
+    else
+    {
+        for (size_t index = 0; index < n; index++)
+        {
+            task(index);
+        }
+    }
+}
+
+// Reads what is needed to know about a data file, without touching anything shared.
+bool CassandraParser::load_data_file(DataFile & file)
+{
+    const std::string fileName = file.dir_string + file.name;
+    struct stat statBuffer;
+    if (stat(fileName.c_str(), &statBuffer) != 0)
+    {
+        fprintf(stderr, "stat(\"%s\") failed: %s\n", fileName.c_str(), strerror(errno));
+        return false;
+    }
+
+    file.regular = (statBuffer.st_mode & S_IFREG) != 0;
+    if (!file.regular)
+    {
+        return true;
+    }
+    file.size = statBuffer.st_size;
+
+    file.version = SStable::getVersionFromFilename(file.name.c_str());
+    if (file.version < 0)
+    {
+        fprintf(stderr, "Tables file name %s does not seem to have a version number in the right place\n", file.name.c_str());
         return false;
     }
 
-    std::string thisKeyspace;
-    std::string thisTable;
-    if (!SStable::extractKeyspaceAndTable(version, name, dir_string, thisKeyspace, thisTable))
+    if (!SStable::extractKeyspaceAndTable(file.version, file.name, file.dir_string, file.keyspace, file.table))
     {
-        fprintf(stderr, "extractKeyspaceAndTable('%s') failed\n", name);
+        fprintf(stderr, "extractKeyspaceAndTable('%s') failed\n", file.name.c_str());
 
         return false;
     }
 
+    file.path = file.dir_string + file.name.substr(0, file.name.size() - DATA_SUFFIX_LEN);
+    TableMetadata & metadata = file.metadata;
+    bool changed = false;
+    if (!MetadataCache::load(file.path, statBuffer, metadata))
+    {
+        metadata = TableMetadata();
+        metadata.compressed = SStable::is_compressed(file.path);
+
+        std::unique_ptr<Buffer> statsFile = Buffer::open_file((file.path + STATISTICS_SUFFIX).c_str(), true);
+        Buffer & statsBuffer = *statsFile;
+        metadata.has_statistics = statsBuffer.good();
+        if (metadata.has_statistics)
+        {
+            metadata.partitioner = SStable::read_metadata(statsBuffer, file.version, metadata.stats, metadata.schema);
+        }
+        SStable::read_summary_keys(file.path, file.version, metadata.first_key, metadata.last_key);
+        changed = true;
+    }
+
+    // verify_digest() checks nothing while checksums are disabled, so an entry made then has to be checked later.
+    if (!metadata.digest_verified && Buffer::isChecksumEnabled())
+    {
+        if (!SStable::verify_digest(TableConfig(file.path, file.version, metadata.compressed)))
+        {
+            return false;
+        }
+        metadata.digest_verified = true;
+        changed = true;
+    }
+
+    if (changed)
+    {
+        MetadataCache::store(file.path, statBuffer, metadata);
+    }
+    return true;
+}
+
+// Adds a loaded file to the set of files associated with this parser.
+bool CassandraParser::add_data_file(const DataFile & file)
+{
     if (m_keyspace.empty() && m_tableName.empty())
     {
-        m_keyspace = thisKeyspace;
-        m_tableName = thisTable;
+        m_keyspace = file.keyspace;
+        m_tableName = file.table;
     }
-    else if (m_keyspace != thisKeyspace || m_tableName != thisTable)
+    else if (m_keyspace != file.keyspace || m_tableName != file.table)
     {
         fprintf(stderr, "ERROR: incompatible keyspace and table for '%s': %s,%s != %s,%s\n",
-                name, m_keyspace.c_str(), m_tableName.c_str(), thisKeyspace.c_str(), thisTable.c_str());
+                file.name.c_str(), m_keyspace.c_str(), m_tableName.c_str(), file.keyspace.c_str(), file.table.c_str());
         return false;
     }
 
-    m_tableConfig.emplace_back(dir_string + std::string(name, namelen - DATA_SUFFIX_LEN), version);
+    const TableMetadata & metadata = file.metadata;
+    m_tableConfig.emplace_back(file.path, file.version, metadata.compressed);
+    TableConfig & config = m_tableConfig.back();
+    config.stats = metadata.stats;
+    config.first_key = metadata.first_key;
+    config.last_key = metadata.last_key;
+
+    // There are usually only a few distinct schemas, however many tables there are.
+    for (const auto & schema : m_schemas)
+    {
+        if (*schema == metadata.schema)
+        {
+            config.schema = schema;
+            return true;
+        }
+    }
+    m_schemas.emplace_back(new TableSchema(metadata.schema));
+    config.schema = m_schemas.back();
     return true;
 }
 
@@ -84,7 +181,8 @@ bool CassandraParser::open(const std::vector<std::string> & paths)
 {
     m_pPartitioner = nullptr;
 
-    const Partitioner * partitioner = nullptr;
+    // Find the data files, then read their metadata in parallel.
+    std::vector<DataFile> files;
     for (auto iter = paths.begin(); iter != paths.end(); iter++)
     {
         std::string dir_string;
@@ -113,50 +211,55 @@ bool CassandraParser::open(const std::vector<std::string> & paths)
             if(namelen > DATA_SUFFIX_LEN &&
                strcmp(dp->d_name + namelen - DATA_SUFFIX_LEN, DATA_SUFFIX) == 0)
             {
-                struct stat statBuffer;
-                const std::string fileName = dir_string + dp->d_name;
-                if (stat(fileName.c_str(), &statBuffer) != 0)
-                {
-                    fprintf(stderr, "stat(\"%s\") failed: %s\n", fileName.c_str(), strerror(errno));
-                    closedir(db_dir);
-                    return false;
-                }
-
-                if ((statBuffer.st_mode & S_IFREG) == 0)
-                {
-                    continue;
-                }
-
-                m_totalFileSize += statBuffer.st_size;
-                ++m_numFiles;
-
-                if (!add_data_file(dir_string, dp->d_name, namelen))
-                {
-                    closedir(db_dir);
-                    return false;
-                }
-
-                const TableConfig & config = m_tableConfig.back();
-                UncompressedBuffer statsBuffer((config.path + STATISTICS_SUFFIX).c_str());
-                if (statsBuffer.good())
-                {
-                    const Partitioner * thisPartitioner = SStable::read_metadata(statsBuffer, config.version, m_tableConfig.back().schema);
-                    if (partitioner == nullptr)
-                    {
-                        partitioner = thisPartitioner;
-                    }
-                    else if (partitioner != thisPartitioner)
-                    {
-                        fprintf(stderr, "Tables do not use the same partitioner, cannot merge\n");
-                        closedir(db_dir);
-                        return false;
-                    }
-                }
+                files.emplace_back();
+                files.back().dir_string = dir_string;
+                files.back().name = dp->d_name;
             }
         }
         closedir(db_dir);
     }
 
+    std::vector<char> loaded(files.size());
+    for_each_index(files.size(), [&](size_t index)
+    {
+        loaded[index] = load_data_file(files[index]);
+    });
+
+    const Partitioner * partitioner = nullptr;
+    for (size_t index = 0; index < files.size(); index++)
+    {
+        const DataFile & file = files[index];
+        if (!loaded[index])
+        {
+            return false;
+        }
+        if (!file.regular)
+        {
+            continue;
+        }
+
+        m_totalFileSize += file.size;
+        ++m_numFiles;
+
+        if (!add_data_file(file))
+        {
+            return false;
+        }
+
+        if (file.metadata.has_statistics)
+        {
+            if (partitioner == nullptr)
+            {
+                partitioner = file.metadata.partitioner;
+            }
+            else if (partitioner != file.metadata.partitioner)
+            {
+                fprintf(stderr, "Tables do not use the same partitioner, cannot merge\n");
+                return false;
+            }
+        }
+    }
+
     if (m_numFiles == 0)
     {
         fprintf(stderr, "No db files found in cassandra files directory.\n");
@@ -170,76 +273,152 @@ bool CassandraParser::open(const std::vector<std::string> & paths)
     }
 
     m_pPartitioner = partitioner;
+    build_column_dictionary();
 
     return true;
 }
 
-CassandraParser::iterator CassandraParser::begin() const
+// Numbers every column named by the tables' schemas, in name order, so that columns can be merged by number.
+// Older tables name each column as it is read, so if there are any the columns are merged by name instead.
+void CassandraParser::build_column_dictionary()
 {
-    std::vector<std::unique_ptr<SStable>> tables;
-    int i = 0;
-    for (auto iter = m_tableConfig.begin(); iter != m_tableConfig.end(); ++iter, i++)
+    m_columns_by_id = true;
+    for (const TableConfig & config : m_tableConfig)
     {
-        std::unique_ptr<SStable> table(SStable::create_table(*iter));
-
-        if (table->init(*m_pPartitioner))
+        if (!SStable::has_schema(config.version))
         {
-            tables.emplace_back(std::move(table));
+            m_columns_by_id = false;
         }
     }
 
-    std::sort(tables.begin(), tables.end(), Sorter(*m_pPartitioner));
+    m_column_names.assign(1, std::string());
+    for (const auto & schema : m_schemas)
+    {
+        for (const auto & column : schema->static_columns)
+            m_column_names.push_back(column.first);
+        for (const auto & column : schema->regular_columns)
+            m_column_names.push_back(column.first);
+    }
+    std::sort(m_column_names.begin(), m_column_names.end());
+    m_column_names.erase(std::unique(m_column_names.begin(), m_column_names.end()), m_column_names.end());
 
-    return iterator(*this, std::move(tables));
+    auto assign_ids = [this](const std::vector<std::pair<std::string, TableSchema::ColumnFormat>> & columns, std::vector<uint32_t> & ids)
+    {
+        ids.clear();
+        for (const auto & column : columns)
+        {
+            ids.push_back(uint32_t(std::lower_bound(m_column_names.begin(), m_column_names.end(), column.first) - m_column_names.begin()));
+        }
+    };
+    for (const auto & schema : m_schemas)
+    {
+        assign_ids(schema->static_columns, schema->static_column_ids);
+        assign_ids(schema->regular_columns, schema->regular_column_ids);
+    }
 }
 
-CassandraParser::iterator CassandraParser::find(const std::string & primaryKey) const
+// Creates an SSTable for every file, positioned at the first row at or after first_token (or at the start if null),
+// and sorts them by the position they are starting at. If in_parallel, the tables are shared among a few threads.
+void CassandraParser::init_tables(std::vector<std::unique_ptr<SStable>> & tables, const Token * first_token, const std::string & first_key,
+                                  bool in_parallel) const
 {
-    CassandraParser::Token first_token;
-    m_pPartitioner->assign_token(first_token, primaryKey.data(), primaryKey.length());
+    std::vector<std::unique_ptr<SStable>> found(m_tableConfig.size());
+    auto init_table = [&](size_t index)
+    {
+        std::unique_ptr<SStable> table(SStable::create_table(m_tableConfig[index]));
+        if (first_token == nullptr ? table->init(*m_pPartitioner) :
+                                     table->init_at_key(*m_pPartitioner, *first_token, first_key))
+        {
+            found[index] = std::move(table);
+        }
+    };
 
-    std::vector<std::unique_ptr<SStable>> tables;
-    int i = 0;
-    for (auto iter = m_tableConfig.begin(); iter != m_tableConfig.end(); ++iter, i++)
+    if (in_parallel)
+    {
+        for_each_index(m_tableConfig.size(), init_table);
+    }
+    else
     {
-        std::unique_ptr<SStable> table(SStable::create_table(*iter));
+        for (size_t index = 0; index < m_tableConfig.size(); index++)
+        {
+            init_table(index);
+        }
+    }
 
-        if (table->init_at_key(*m_pPartitioner, first_token, primaryKey))
+    for (auto & table : found)
+    {
+        if (table)
         {
             tables.emplace_back(std::move(table));
         }
     }
 
-    std::sort(tables.begin(), tables.end(), Sorter(*m_pPartitioner));
+    std::sort(tables.begin(), tables.end(), Sorter());
+}
 
+CassandraParser::iterator CassandraParser::begin() const
+{
+    std::vector<std::unique_ptr<SStable>> tables;
+    init_tables(tables, nullptr, std::string(), true);
     return iterator(*this, std::move(tables));
 }
 
-// Find set of tables with lowest ordered partition (row) key.
-bool CassandraParser::iterator::match_table(size_t * matches, size_t & n_matches, size_t index)
+CassandraParser::iterator CassandraParser::find(const std::string & primaryKey) const
 {
-    const CassandraParser::Token & next_token = m_tables[index]->next_token();
-    const std::string & next_key = m_tables[index]->next_key();
+    CassandraParser::Token first_token;
+    m_pPartitioner->assign_token(first_token, primaryKey.data(), primaryKey.length());
 
-    int comparison = -1;
-    if (n_matches > 0)
-    {
-        const SStable & smallest_table = *m_tables[matches[0]];
-        comparison = m_parser.m_pPartitioner->compare_token(next_token, next_key, smallest_table.next_token(), smallest_table.next_key());
-    }
+    std::vector<std::unique_ptr<SStable>> tables;
+    init_tables(tables, &first_token, primaryKey, true);
+    return iterator(*this, std::move(tables));
+}
 
-    if (comparison < 0)
+// Creates an iterator that will only return rows in the given range.
+// Each parsing thread seeks its own ranges, so the tables are set up on the calling thread rather than in a pool
+// per range, which would start a pool's worth of threads for every range on every parsing thread.
+CassandraParser::iterator CassandraParser::find_range(const TokenRange & range) const
+{
+    std::vector<std::unique_ptr<SStable>> tables;
+    init_tables(tables, range.has_start ? &range.start_token : nullptr, range.start_key, false);
+    return iterator(*this, std::move(tables), &range);
+}
+
+// Divides the token ring into (up to) n_ranges ranges that may be iterated independently of each other.
+// If first_key is given, everything before it is left out.
+// Partitioners that do not hash keys cannot be divided, so will always produce a single range.
+void CassandraParser::split_token_ring(std::vector<TokenRange> & ranges, size_t n_ranges, const char * first_key) const
+{
+    ranges.assign(1, TokenRange());
+    if (first_key != nullptr)
     {
-        matches[0] = index;
-        n_matches = 1;
-        return true;
+        ranges[0].has_start = true;
+        ranges[0].start_key = first_key;
+        m_pPartitioner->assign_token(ranges[0].start_token, ranges[0].start_key.data(), ranges[0].start_key.length());
     }
-    else if (comparison == 0)
+
+    const std::string no_key;
+    for (size_t i = 1; i < n_ranges; i++)
     {
-        matches[n_matches++] = index;
-        return true;
+        Token boundary;
+        if (!m_pPartitioner->split_token(boundary, i, n_ranges))
+        {
+            break;
+        }
+
+        // An empty key sorts before every other key with the same token, so this is the very start of the token
+        if (first_key != nullptr &&
+            Partitioner::compare_token(boundary, no_key, ranges[0].start_token, ranges[0].start_key) <= 0)
+        {
+            continue;
+        }
+
+        ranges.back().has_end = true;
+        ranges.back().end_token = boundary;
+
+        ranges.emplace_back();
+        ranges.back().has_start = true;
+        ranges.back().start_token = boundary;
     }
-    return false;
 }
 
 // This will make the specified table "active", i.e. spanning the position currently being iterated.
@@ -251,78 +430,73 @@ void CassandraParser::iterator::activate_table(size_t index)
         m_tables[index]->open() &&
         !m_tables[index]->read_row(m_parser.m_pPartitioner))
     {
-        m_active_tables.insert(index);
+        m_active_tables.push(index, RowOrder(*this));
     }
 }
 
 // This will make the specified table "inactive", i.e. not spanning the position currently being iterated.
+// It must not be left in m_active_tables.
 void CassandraParser::iterator::deactivate_table(size_t index)
 {
     m_tables[index]->close();
-    m_active_tables.erase(index);
 }
 
-size_t CassandraParser::iterator::find_first_row_matches(size_t * matches)
+int CassandraParser::iterator::RowOrder::operator()(size_t a, size_t b) const
 {
-    size_t n_matches = 0;
-    for (std::set<size_t>::iterator iter = m_active_tables.begin(); iter != m_active_tables.end(); iter++)
-    {
-        match_table(matches, n_matches, *iter);
-    }
-
-    // Find if we should open any more tables!
-    while(m_next_table < m_tables.size() && match_table(matches, n_matches, m_next_table))
-    {
-        activate_table(m_next_table++);
-    }
-
-    assert(n_matches > 0 || m_active_tables.empty());
-    return n_matches;
+    const SStable & table_a = *m_iterator.m_tables[a];
+    const SStable & table_b = *m_iterator.m_tables[b];
+    return Partitioner::compare_token(table_a.next_token(), table_a.next_key(), table_b.next_token(), table_b.next_key());
 }
 
+// Returns true if the next row of this table is beyond the range being iterated.
+bool CassandraParser::iterator::is_past_end(const SStable & table) const
+{
+    static const std::string no_key;
+    return m_has_end && Partitioner::compare_token(table.next_token(), table.next_key(), m_end_token, no_key) >= 0;
+}
 
-// This will find the lexical first column out of all the next columns of all the tables reading the active row.
-// it will write the indexes into matched_columns and return the total number of matches to that column.
-// if all the tables pointing to this row are exhausted, it will return 0
-size_t CassandraParser::iterator::find_first_column_matches(size_t * matched_columns,
-                                                      const size_t * matches,
-                                                      const size_t n_matches)
+// Takes the tables whose next row is the first from m_active_tables. The caller must give them back with
+// m_active_tables.replace_taken() once it has read their rows.
+size_t CassandraParser::iterator::find_first_row_matches(size_t * matches)
 {
-    size_t column_matches = 0;
-    const std::string * pMinString = NULL;
-    // Columns are sorted, so find the first column
-    for (size_t i = 0; i < n_matches; i++)
+    // Find if we should open any more tables! They are sorted by where they start, so stop at the first that starts later.
+    const RowOrder row_order(*this);
+    while (m_next_table < m_tables.size() &&
+           (m_active_tables.empty() || row_order(m_next_table, m_active_tables.front(row_order)) <= 0))
     {
-        const size_t this_column = matches[i];
-        const std::string & this_identifier = m_tables[this_column]->next_column().name;
+        activate_table(m_next_table++);
+    }
 
-        const int comparision = pMinString == NULL ? -1 : (std::strcmp(this_identifier.c_str(), pMinString->c_str()));
+    const size_t n_matches = m_active_tables.take_first(matches, row_order);
 
-        if (comparision < 0)
-        {
-            pMinString = &this_identifier;
-            matched_columns[0] = this_column;
-            column_matches = 1;
-        }
-        else if (comparision == 0)
+    if (n_matches > 0 && is_past_end(*m_tables[matches[0]]))
+    {
+        // Everything else belongs to another range.
+        for (size_t index : m_active_tables.entries())
         {
-            matched_columns[column_matches++] = this_column;
+            deactivate_table(index);
         }
+        m_active_tables.clear();
+        m_next_table = m_tables.size();
+        m_finished = true;
+        return 0;
     }
-    return column_matches;
+    return n_matches;
 }
 
+
 // This will pick the most recent out of all versions of the same column being iterated.
-SStable & CassandraParser::iterator::choose_latest_match(const size_t * matched_columns, const size_t column_matches)
+SStable & CassandraParser::iterator::choose_latest_match(const NextColumn * matched_columns, const size_t column_matches)
 {
     // Find the newest value of that column
-    size_t lastTs_index = matched_columns[0];
+    size_t lastTs_index = matched_columns[0].table;
     int64_t lastTs = m_tables[lastTs_index]->next_column().ts;
     for (size_t i = 1; i < column_matches; i++)
     {
-        size_t this_index = matched_columns[i];
+        size_t this_index = matched_columns[i].table;
         const int64_t thisTs = m_tables[this_index]->next_column().ts;
-        if (thisTs > lastTs)
+        // Ties go to the first table, whatever order the matches were found in.
+        if (thisTs > lastTs || (thisTs == lastTs && this_index < lastTs_index))
         {
             lastTs = thisTs;
             lastTs_index = this_index;
@@ -332,13 +506,53 @@ SStable & CassandraParser::iterator::choose_latest_match(const size_t * matched_
     return *m_tables[lastTs_index];
 }
 
-// This will add range tombstones from the SSTable into the set of tombstones being currently considered
+// Adds a range tombstone ending at end, or moves an existing one at the same end to ts if that is later.
+void CassandraParser::iterator::add_tombstone(const std::string & end, int64_t ts)
+{
+    const auto first = m_tombstones.begin();
+    const auto last = first + m_n_tombstones;
+    auto found = std::lower_bound(first, last, end, [](const RangeTombstone & tombstone, const std::string & key)
+    {
+        return tombstone.end > key;
+    });
+
+    if (found != last && found->end == end)
+    {
+        if (found->ts >= ts)
+            return;
+        found->ts = ts;
+    }
+    else
+    {
+        // Fill a spare entry and rotate it into place, which swaps the strings rather than copying them.
+        if (m_tombstones.size() == m_n_tombstones)
+        {
+            const size_t position = found - first;
+            m_tombstones.emplace_back();
+            found = m_tombstones.begin() + position;
+        }
+        RangeTombstone & spare = m_tombstones[m_n_tombstones];
+        spare.end = end;
+        spare.ts = ts;
+        std::rotate(found, m_tombstones.begin() + m_n_tombstones, m_tombstones.begin() + m_n_tombstones + 1);
+        m_n_tombstones++;
+    }
+
+    // Only the entries from here on can have a different maximum.
+    int64_t max_ts = found == m_tombstones.begin() ? SStable::STILL_ACTIVE : (found - 1)->max_ts;
+    for (auto iter = found; iter != m_tombstones.begin() + m_n_tombstones; ++iter)
+    {
+        if (max_ts == SStable::STILL_ACTIVE || max_ts < iter->ts)
+            max_ts = iter->ts;
+        iter->max_ts = max_ts;
+    }
+}
+
+// This will add range tombstones from the SSTables into the set of tombstones being currently considered
 // as well as removing any tombstones that have been passed completely.
-void CassandraParser::iterator::update_tombstones(std::map<std::string, int64_t> &tombstones,
-                                                   int64_t & minTime, const size_t * matches,
-                                                   const size_t n_matches,
-                                                   const int64_t marked_for_deletion,
-                                                   const std::string & name) const
+// matches need only be the tables whose next column is a range tombstone.
+void CassandraParser::iterator::update_tombstones(int64_t & minTime, const size_t * matches, const size_t n_matches,
+                                                   const int64_t marked_for_deletion, const StringView & name)
 {
     for (size_t i = 0; i < n_matches; i++)
     {
@@ -346,25 +560,26 @@ void CassandraParser::iterator::update_tombstones(std::map<std::string, int64_t>
         if (m_tables[this_column]->next_column().range_tombstone)
         {
             const int64_t ts = m_tables[this_column]->next_column().ts;
-            const std::string & range_end = m_tables[this_column]->next_column().data;
-            auto found = tombstones.find(range_end);
-            if (found == tombstones.end() || found->second < ts)
-                tombstones[range_end] = ts;
+            add_tombstone(m_tables[this_column]->next_column().data, ts);
             if (minTime == SStable::STILL_ACTIVE || minTime < ts)
                     minTime = ts;
         }
     }
 
     // Erase any range tombstones that we passed
-    auto lower_bound = tombstones.lower_bound(name);
-    if (lower_bound != tombstones.begin())
+    size_t remaining = m_n_tombstones;
+    while (remaining > 0 && StringView(m_tombstones[remaining - 1].end).compare(name) < 0)
+    {
+        remaining--;
+    }
+    if (remaining != m_n_tombstones)
     {
-        tombstones.erase(tombstones.begin(), lower_bound);
-        // Recalculate the minimum timestamp of active records based on new range of tombstones
+        m_n_tombstones = remaining;
+        // The minimum timestamp of active records is now that of the tombstones left
         minTime = marked_for_deletion;
-        for (auto iter = tombstones.begin(); iter != tombstones.end(); iter++)
+        if (remaining > 0)
         {
-            const int64_t ts = iter->second;
+            const int64_t ts = m_tombstones[remaining - 1].max_ts;
             if (minTime == SStable::STILL_ACTIVE || minTime < ts)
                 minTime = ts;
         }
@@ -376,6 +591,9 @@ bool CassandraParser::iterator::next(DatabaseRow & row)
 {
     do
     {
+        if (m_finished)
+            return false;
+
         if (m_active_tables.empty())
         {
             if (m_next_table >= m_tables.size())
@@ -393,7 +611,7 @@ bool CassandraParser::iterator::next(DatabaseRow & row)
 // Note that this MAY possibly not correspond to a the row returned by next_record as it may not be live.
 bool CassandraParser::iterator::get_next_key(std::string & key)
 {
-    if (m_active_tables.empty() && m_next_table >= m_tables.size())
+    if (m_finished || (m_active_tables.empty() && m_next_table >= m_tables.size()))
     {
         return false;
     }
@@ -405,6 +623,7 @@ bool CassandraParser::iterator::get_next_key(std::string & key)
         return false;
     }
     key = m_tables[matches[0]]->next_key();
+    m_active_tables.replace_taken([](size_t) { return true; }, RowOrder(*this));
     return true;
 }
 
@@ -413,17 +632,16 @@ bool CassandraParser::iterator::get_next_key(std::string & key)
 bool CassandraParser::iterator::next_record(DatabaseRow & row)
 {
     size_t * matches = (size_t *)alloca(sizeof(size_t) * m_tables.size());
-    const size_t original_n_matches = find_first_row_matches(matches);
+    const size_t n_matches = find_first_row_matches(matches);
 
-    if (original_n_matches == 0)
+    if (n_matches == 0)
     {
         return false;
     }
 
-    size_t n_matches = original_n_matches;
 #ifdef DEBUG
-    assert(m_last_key.empty() || m_parser.m_pPartitioner->compare_token(m_tables[matches[0]]->next_token(), m_tables[matches[0]]->next_key(), m_last_token, m_last_key) >= 0);
-    memcpy(&m_last_token, &m_tables[matches[0]]->next_token(), sizeof(Token));
+    assert(m_last_key.empty() || Partitioner::compare_token(m_tables[matches[0]]->next_token(), m_tables[matches[0]]->next_key(), m_last_token, m_last_key) >= 0);
+    m_last_token = m_tables[matches[0]]->next_token();
     m_last_key = m_tables[matches[0]]->next_key();
 
     for (size_t i = 1; i < n_matches; i++)
@@ -446,32 +664,39 @@ bool CassandraParser::iterator::next_record(DatabaseRow & row)
         }
     }
 
-    // Sometimes a row might not have any columns.
-    for (size_t i = 0; i < n_matches;)
+    bool has_columns = false;
+
+    m_n_tombstones = 0;
+    int64_t minTime = marked_for_deletion;
+
+    // The tables positioned on a range tombstone, which only change as tables move on to their next column.
+    size_t * on_tombstone = (size_t *)alloca(sizeof(size_t) * n_matches);
+    size_t n_on_tombstone = 0;
+
+    // This will find the lexical first column out of all the next columns of all the tables reading the active row.
+    const ColumnOrder column_order(m_parser.m_columns_by_id);
+    m_column_heap.clear();
+    for (size_t i = 0; i < n_matches; i++)
     {
+        // Sometimes a row might not have any columns.
         const size_t index = matches[i];
-        if (m_tables[index]->has_columns())
+        if (!m_tables[index]->has_columns())
         {
-            i++;
+            continue;
         }
-        else
+        const NextColumn next_column = { m_tables[index]->next_column().name, m_tables[index]->next_column().id, index };
+        m_column_heap.push(next_column, column_order);
+        if (m_tables[index]->next_column().range_tombstone)
         {
-            --n_matches;
-            matches[i] = matches[n_matches];
-            matches[n_matches] = index;
+            on_tombstone[n_on_tombstone++] = index;
         }
     }
 
-    bool has_columns = false;
-
-    std::map<std::string, int64_t> tombstones;
-    int64_t minTime = marked_for_deletion;
-
-    size_t * matched_columns = (size_t *)alloca(sizeof(size_t) * n_matches);
-    while (size_t column_matches = find_first_column_matches(matched_columns, matches, n_matches))
+    NextColumn * matched_columns = (NextColumn *)alloca(sizeof(NextColumn) * n_matches);
+    while (size_t column_matches = m_column_heap.take_first(matched_columns, column_order))
     {
-        const std::string & name = m_tables[matched_columns[0]]->next_column().name;
-        update_tombstones(tombstones, minTime, matches, n_matches, marked_for_deletion, name);
+        const StringView name = m_parser.m_columns_by_id ? StringView(m_parser.m_column_names[matched_columns[0].id]) : matched_columns[0].name;
+        update_tombstones(minTime, on_tombstone, n_on_tombstone, marked_for_deletion, name);
 
         // Pick the latest
         SStable & lastest_table = choose_latest_match(matched_columns, column_matches);
@@ -480,44 +705,55 @@ bool CassandraParser::iterator::next_record(DatabaseRow & row)
         // Empty names are associated with clustering columns, check to see if the row has been deleted since the value was written
         if (!name.empty() && !nextColumn.deleted && (minTime == SStable::STILL_ACTIVE || minTime < nextColumn.ts))
         {
-            std::string data;
+            StringView data;
             lastest_table.read_column_data(data);
+            const SharedBlock & block = lastest_table.block_of(data);
             if (nextColumn.expiring)
             {
-                row.new_column_with_ttl(name, data, nextColumn.ts, nextColumn.extra_data.expiration.ttl, nextColumn.extra_data.expiration.expiration);
+                row.new_column_with_ttl(name, data, block, nextColumn.ts, nextColumn.extra_data.expiration.ttl, nextColumn.extra_data.expiration.expiration);
             }
             else
             {
-                row.new_column(name, data, nextColumn.ts);
+                row.new_column(name, data, block, nextColumn.ts);
             }
             has_columns = true;
         }
 
-        // For each matched column, move on.
-        for (size_t i = 0; i < column_matches; i++)
+        // For each matched column, move on. Tables with no more columns drop out of the heap.
+        m_column_heap.replace_taken([&](NextColumn & next_column)
         {
-            const size_t index = matched_columns[i];
+            const size_t index = next_column.table;
+            size_t * was_on_tombstone = std::find(on_tombstone, on_tombstone + n_on_tombstone, index);
+            if (was_on_tombstone != on_tombstone + n_on_tombstone)
+            {
+                *was_on_tombstone = on_tombstone[--n_on_tombstone];
+            }
+
             if (!m_tables[index]->read_column())
             {
-                // No more columns, remove from set of row matches (this is a no-op when removing the last table)
-                size_t * position = std::find(matches, matches + n_matches, index);
-                --n_matches;
-                *position = matches[n_matches];
-                matches[n_matches] = index;
+                return false;
             }
-        }
+            next_column.name = m_tables[index]->next_column().name;
+            next_column.id = m_tables[index]->next_column().id;
+            if (m_tables[index]->next_column().range_tombstone)
+            {
+                on_tombstone[n_on_tombstone++] = index;
+            }
+            return true;
+        }, column_order);
     }
 
-    for (size_t i = 0; i < original_n_matches; i++)
+    // And prepare the next row so its pointing in the right place
+    m_active_tables.replace_taken([this](size_t index)
     {
-        const size_t index = matches[i];
-        // And prepare the next row so its pointing in the right place
         if (m_tables[index]->read_row(m_parser.m_pPartitioner))
         {
             // EOF
             deactivate_table(index);
+            return false;
         }
-    }
+        return true;
+    }, RowOrder(*this));
 
     ++m_cassandraReadRecords;
 
@@ -531,12 +767,19 @@ bool CassandraParser::iterator::next_record(DatabaseRow & row)
     return true;
 }
 
-CassandraParser::iterator::iterator(const CassandraParser & parser, std::vector<std::unique_ptr<SStable>> && tables) :
+CassandraParser::iterator::iterator(const CassandraParser & parser, std::vector<std::unique_ptr<SStable>> && tables, const TokenRange * range) :
     m_parser(parser),
     m_next_table(0),
+    m_n_tombstones(0),
     m_skippedRecords(0),
-    m_cassandraReadRecords(0)
+    m_cassandraReadRecords(0),
+    m_has_end(range != nullptr && range->has_end),
+    m_finished(false)
 {
+    if (m_has_end)
+    {
+        m_end_token = range->end_token;
+    }
     m_tables.swap(tables);
 }
 
@@ -544,12 +787,16 @@ CassandraParser::iterator::iterator(const iterator & other) :
     m_parser(other.m_parser),
     m_next_table(other.m_next_table),
     m_active_tables(other.m_active_tables),
+    m_n_tombstones(0),
     m_skippedRecords(other.m_skippedRecords),
-    m_cassandraReadRecords(other.m_cassandraReadRecords)
+    m_cassandraReadRecords(other.m_cassandraReadRecords),
+    m_has_end(other.m_has_end),
+    m_finished(other.m_finished)
 {
+    m_end_token = other.m_end_token;
 #ifdef DEBUG
     m_last_key = other.m_last_key;
-    memcpy(m_last_token, other.m_last_token, sizeof(Token));
+    m_last_token = other.m_last_token;
 #endif
     for (auto & entry : other.m_tables)
     {
@@ -557,6 +804,8 @@ CassandraParser::iterator::iterator(const iterator & other) :
     }
 }
 
+CassandraParser::iterator::iterator(iterator && other) = default;
+
 // this is required to isolate the destruction of SSTables to where they are defined
 CassandraParser::iterator::~iterator()
 {
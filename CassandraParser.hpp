@@ -19,45 +19,71 @@
 #define parse_cassandra_h
 
 #include "Buffer.hpp"
+#include "MergeHeap.hpp"
+#include "MetadataCache.hpp"
 #include "SSTableSchema.hpp"
 
-#include <set>
-#include <map>
 #include <memory>
+#include <mutex>
 #include <vector>
 
+class IndexSummary;
 class Partitioner;
 class SStable;
 
 struct TableConfig
 {
-    TableConfig(const std::string & p, int v) : path(p), version(v) {}
+    TableConfig(const std::string & p, int v, bool c) : path(p), version(v), compressed(c),
+        compression_info_loaded(new std::once_flag), summary_loaded(new std::once_flag) {}
     const std::string path;
     const int version;
-    TableSchema schema;
+    const bool compressed;
+    EncodingStats stats;
+    // Tables with the same columns share one schema.
+    std::shared_ptr<const TableSchema> schema;
+    // Empty if the table's format does not record them.
+    std::string first_key;
+    std::string last_key;
+    // Loaded by the first open() of the table, so that tables outside every range being read never need it.
+    // Null for uncompressed tables.
+    std::unique_ptr<std::once_flag> compression_info_loaded;
+    mutable std::shared_ptr<const CompressionInfo> compression_info;
+    // Loaded by the first seek into the table, which may be on any parsing thread. Null if there is no summary.
+    std::unique_ptr<std::once_flag> summary_loaded;
+    mutable std::shared_ptr<const IndexSummary> summary;
 };
 
 class CassandraParser
 {
 public:
-    // This should be long enough for the longest token.
-    typedef uint8_t Token[16];
+    // Tokens are kept so that they sort as a pair of unsigned integers, whatever the partitioner, which lets
+    // them be compared without asking it. Partitioners that do not hash keys leave them at zero.
+    struct Token
+    {
+        uint64_t high;
+        uint64_t low;
+    };
 
     class DatabaseRow
     {
     public:
-        virtual void new_row(const std::string & key) = 0;
-        virtual void new_column(const std::string & column_name, const std::string & column_value, int64_t ts) = 0;
-        virtual void new_column_with_ttl(const std::string & column_name, const std::string & column_value, int64_t ts, uint32_t ttl,                               uint32_t ttlTimestampSecs) = 0;
+        // The views are only valid for the duration of the call, but if value_block is set it holds column_value,
+        // and keeping a reference to it keeps the value valid too.
+        virtual void new_row(const StringView & key) = 0;
+        virtual void new_column(const StringView & column_name, const StringView & column_value, const SharedBlock & value_block, int64_t ts) = 0;
+        virtual void new_column_with_ttl(const StringView & column_name, const StringView & column_value, const SharedBlock & value_block, int64_t ts, uint32_t ttl,                               uint32_t ttlTimestampSecs) = 0;
     };
     
     struct ColumnInfo
     {
-        ColumnInfo() : deleted(false), expiring(false), range_tombstone(false), ts(0LL) { extra_data.counter_timestamp = 0LL; }
+        ColumnInfo() : deleted(false), expiring(false), range_tombstone(false), id(0), ts(0LL) { extra_data.counter_timestamp = 0LL; }
         bool deleted;
         bool expiring;
         bool range_tombstone;
-        std::string name;
+        // Refers to the schema, or to storage in the SSTable for formats that name every column.
+        StringView name;
+        // The name's position in the column dictionary, for formats with a schema. 0 is the empty name.
+        uint32_t id;
         int64_t ts;
         union
         {
@@ -71,7 +97,19 @@ public:
         }
     };
 
-    CassandraParser() : m_totalFileSize(0), m_numFiles(0) {}
+    // A contiguous part of the token ring. A range includes its start and excludes its end.
+    // A range without a start begins at the first row, a range without an end runs until the last one.
+    struct TokenRange
+    {
+        TokenRange() : has_start(false), has_end(false) {}
+        bool has_start;
+        Token start_token;
+        std::string start_key; // Empty unless starting on a particular key
+        bool has_end;
+        Token end_token;
+    };
+
+    CassandraParser() : m_totalFileSize(0), m_numFiles(0), m_columns_by_id(false) {}
 
     off_t getTotalFileSize() const { return m_totalFileSize; }
     off_t getNumFiles() const { return m_numFiles; }
@@ -79,38 +117,81 @@ public:
     const std::string& getTableName() const { return m_tableName; }
 
     bool open(const std::vector<std::string> & path);
-    bool add_data_file(const std::string & dir_string, const char * name, size_t namelen);
 
     class iterator
     {
         const CassandraParser &         m_parser;
         size_t                          m_next_table;
-        std::set<size_t>                m_active_tables;
+        // The name is kept with the table so that comparing them goes no further than the heap.
+        struct NextColumn
+        {
+            StringView name;
+            uint32_t id;
+            size_t table;
+        };
+        // The dictionary is in name order, so comparing ids gives the same order as comparing names.
+        struct ColumnOrder
+        {
+            const bool m_by_id;
+            explicit ColumnOrder(bool by_id) : m_by_id(by_id) {}
+            int operator()(const NextColumn & a, const NextColumn & b) const
+            {
+                if (m_by_id)
+                {
+                    return a.id < b.id ? -1 : a.id > b.id ? 1 : 0;
+                }
+                return a.name.compare(b.name);
+            }
+        };
+        // Compares table a's next row with table b's.
+        struct RowOrder
+        {
+            const iterator & m_iterator;
+            explicit RowOrder(const iterator & parent) : m_iterator(parent) {}
+            int operator()(size_t a, size_t b) const;
+        };
+
+        // The open tables, ordered by their next row.
+        MergeHeap<size_t>               m_active_tables;
+        // The tables with columns in the row being read, ordered by their next column.
+        MergeHeap<NextColumn>           m_column_heap;
+        // The range tombstones covering the row being read, by descending end so that those passed come off the back.
+        struct RangeTombstone
+        {
+            std::string end;
+            int64_t ts;
+            int64_t max_ts; // The latest ts of this and every tombstone before it
+        };
+        std::vector<RangeTombstone>     m_tombstones;
+        // Entries past this are spare, and kept for their strings' storage.
+        size_t                          m_n_tombstones;
         std::vector<std::unique_ptr<SStable>> m_tables;
         size_t                          m_skippedRecords;
         size_t                          m_cassandraReadRecords;
+        bool                            m_has_end;
+        Token                           m_end_token;
+        bool                            m_finished;
 #ifdef DEBUG
         Token                           m_last_token;
         std::string                     m_last_key;
 #endif
-        bool match_table(size_t * matches, size_t & n_matches, size_t index);
         void activate_table(size_t index);
         void deactivate_table(size_t index);
 
+        bool is_past_end(const SStable & table) const;
         size_t find_first_row_matches(size_t * matches);
-        size_t find_first_column_matches(size_t * matched_columns, const size_t * matches, const size_t n_matches);
 
-        void update_tombstones(std::map<std::string, int64_t> &tombstones, int64_t & minTime,
-                                const size_t * matches, const size_t n_matches,
-                                const int64_t marked_for_deletion,
-                                const std::string & name) const;
-        SStable & choose_latest_match(const size_t * matched_columns, const size_t column_matches);
+        void add_tombstone(const std::string & end, int64_t ts);
+        void update_tombstones(int64_t & minTime, const size_t * matches, const size_t n_matches,
+                               const int64_t marked_for_deletion, const StringView & name);
+        SStable & choose_latest_match(const NextColumn * matched_columns, const size_t column_matches);
 
         bool next_record(DatabaseRow & row);
     public:
 
-        iterator(const CassandraParser & parser, std::vector<std::unique_ptr<SStable>> && tables);
+        iterator(const CassandraParser & parser, std::vector<std::unique_ptr<SStable>> && tables, const TokenRange * range = nullptr);
         iterator(const iterator & other);
+        iterator(iterator && other);
         ~iterator();
 
         size_t getSkippedRecords() const { return m_skippedRecords; }
@@ -122,23 +203,46 @@ public:
 
     iterator find(const std::string & primaryKey) const;
     iterator begin() const;
+    iterator find_range(const TokenRange & range) const;
+    void split_token_ring(std::vector<TokenRange> & ranges, size_t n_ranges, const char * first_key) const;
 private:
+    void init_tables(std::vector<std::unique_ptr<SStable>> & tables, const Token * first_token, const std::string & first_key,
+                     bool in_parallel) const;
+    // What open() finds out about each data file before adding it.
+    struct DataFile
+    {
+        DataFile() : regular(false), size(0), version(-1) {}
+        std::string dir_string;
+        std::string name;
+        bool regular;
+        off_t size;
+        int version;
+        std::string keyspace;
+        std::string table;
+        std::string path;
+        TableMetadata metadata;
+    };
+    static bool load_data_file(DataFile & file);
+    bool add_data_file(const DataFile & file);
+    void build_column_dictionary();
 
     struct Sorter
     {
-        const Partitioner & m_partitioner;
         bool operator()(const SStable & a, const SStable & b);
         bool operator()(const std::unique_ptr<SStable> & a, const std::unique_ptr<SStable> & b);
-        explicit Sorter(const Partitioner & partitioner) : m_partitioner(partitioner) {}
     };
 
     std::vector<TableConfig>        m_tableConfig;
+    // The distinct schemas that the tables share.
+    std::vector<std::shared_ptr<TableSchema>> m_schemas;
     const Partitioner *             m_pPartitioner;
     off_t                           m_totalFileSize;
     size_t                          m_numFiles;
     std::string                     m_keyspace;
     std::string                     m_tableName;
-
+    // Every column named by a schema, sorted. Tables are merged by column id if they all have a schema.
+    std::vector<std::string>        m_column_names;
+    bool                            m_columns_by_id;
 
     static int compare_start_tokens(void * pVPartition, const void * aa, const void * bb);
 };
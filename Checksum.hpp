@@ -0,0 +1,28 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  Checksum.hpp
+//  CRC32 and Adler32 using SIMD instructions where the CPU has them.
+
+#ifndef Checksum_hpp
+#define Checksum_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+// These take and return the same values as zlib's crc32() and adler32(), which they fall back to.
+uint32_t fast_crc32(uint32_t crc, const uint8_t * data, size_t len);
+uint32_t fast_adler32(uint32_t adler, const uint8_t * data, size_t len);
+
+#endif /* Checksum_hpp */
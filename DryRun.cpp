@@ -22,11 +22,11 @@
 class TestDatabaseRow : public CassandraParser::DatabaseRow
 {
 public:
-    virtual void new_row(const std::string & key_string) final
+    virtual void new_row(const StringView & key_string) final
     {
         if (isPrintable(key_string))
         {
-            printf ("%s:\n", key_string.c_str());
+            printf ("%.*s:\n", (int)key_string.size(), key_string.data());
         }
         else
         {
@@ -35,29 +35,31 @@ public:
     }
 
     // This are for columns with no expiry time set
-    virtual void new_column(const std::string & column_name, const std::string & column_value, int64_t ts) final
+    virtual void new_column(const StringView & column_name, const StringView & column_value, const SharedBlock & value_block, int64_t ts) final
     {
         if (isPrintable(column_value))
         {
-            printf ("%s=%s\n", column_name.c_str(), column_value.c_str());
+            printf ("%.*s=%.*s\n", (int)column_name.size(), column_name.data(), (int)column_value.size(), column_value.data());
         }
         else
         {
-            printf ("%s=%s\n", column_name.c_str(), binaryToHex(column_value).c_str());
+            printf ("%.*s=%s\n", (int)column_name.size(), column_name.data(), binaryToHex(column_value).c_str());
         }
     }
 
     // This is for columns that do expire.
-    virtual void new_column_with_ttl(const std::string & column_name, const std::string & column_value,
+    virtual void new_column_with_ttl(const StringView & column_name, const StringView & column_value, const SharedBlock & value_block,
                                      int64_t ts, uint32_t ttl, uint32_t ttlTimestampSecs) final
     {
         if (isPrintable(column_value))
         {
-            printf ("%s=%s (timeout=%lu)\n", column_name.c_str(), column_value.c_str(), (unsigned long)ttlTimestampSecs);
+            printf ("%.*s=%.*s (timeout=%lu)\n", (int)column_name.size(), column_name.data(),
+                    (int)column_value.size(), column_value.data(), (unsigned long)ttlTimestampSecs);
         }
         else
         {
-            printf ("%s=%s (timeout=%lu)\n", column_name.c_str(), binaryToHex(column_value).c_str(), (unsigned long)ttlTimestampSecs);
+            printf ("%.*s=%s (timeout=%lu)\n", (int)column_name.size(), column_name.data(),
+                    binaryToHex(column_value).c_str(), (unsigned long)ttlTimestampSecs);
         }
     }
 };
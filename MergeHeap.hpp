@@ -0,0 +1,249 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  MergeHeap.hpp
+//  Merges sorted streams by the key each one is currently at.
+
+#ifndef MergeHeap_hpp
+#define MergeHeap_hpp
+
+#include <stddef.h>
+
+#include <vector>
+
+// A binary heap of streams, with the stream whose key comes first at the front. Entry is whatever identifies a stream
+// (and perhaps caches its key). The order is given by a compare(a, b) function passed to each call, which returns less
+// than, equal to or greater than zero as stream a's key comes before, at or after stream b's. Being three way, it
+// tells a scan whether an entry is equal to the first so far or before it with one call.
+//
+// Every stream at the first key is taken at once, and they stay where they are while the caller reads from them.
+// They form a subtree at the root, so putting them back is a bottom-up heapify of just those positions, which costs
+// O(log K) for each stream taken. A few streams are cheaper to scan than to keep in order, so up to LINEAR_LIMIT
+// of them are left unordered. So are any number while more than a quarter of them are taken each time, as when every
+// stream holds every key, because then a scan finds them with fewer comparisons than the heap needs to put them back.
+template<class Entry>
+class MergeHeap
+{
+    static const size_t LINEAR_LIMIT = 16;
+
+    std::vector<Entry> m_heap;
+    // Where the taken streams are, in increasing order.
+    std::vector<size_t> m_taken;
+    bool m_ordered;
+    // Set while many streams are taken each time. It outlives clear(), as a heap that is refilled for each row of
+    // a table tends to be refilled the same way.
+    bool m_scanning;
+
+    template<class Compare>
+    void sift_down(size_t position, Compare compare)
+    {
+        const Entry value = m_heap[position];
+        for (;;)
+        {
+            size_t child = 2 * position + 1;
+            if (child >= m_heap.size())
+            {
+                break;
+            }
+            if (child + 1 < m_heap.size() && compare(m_heap[child], m_heap[child + 1]) > 0)
+            {
+                child++;
+            }
+            if (compare(value, m_heap[child]) <= 0)
+            {
+                break;
+            }
+            m_heap[position] = m_heap[child];
+            position = child;
+        }
+        m_heap[position] = value;
+    }
+
+    template<class Compare>
+    void heapify(Compare compare)
+    {
+        for (size_t position = m_heap.size() / 2; position > 0; position--)
+        {
+            sift_down(position - 1, compare);
+        }
+        m_ordered = true;
+    }
+
+    template<class Compare>
+    void sift_up(size_t position, Compare compare)
+    {
+        const Entry value = m_heap[position];
+        while (position > 0)
+        {
+            const size_t parent = (position - 1) / 2;
+            if (compare(m_heap[parent], value) <= 0)
+            {
+                break;
+            }
+            m_heap[position] = m_heap[parent];
+            position = parent;
+        }
+        m_heap[position] = value;
+    }
+
+public:
+    MergeHeap() : m_ordered(false), m_scanning(false) {}
+
+    bool empty() const
+    {
+        return m_heap.empty();
+    }
+
+    // The entries in no particular order.
+    const std::vector<Entry> & entries() const
+    {
+        return m_heap;
+    }
+
+    // The stream whose key comes first. The heap must not be empty.
+    template<class Compare>
+    const Entry & front(Compare compare) const
+    {
+        size_t first = 0;
+        if (!m_ordered)
+        {
+            for (size_t position = 1; position < m_heap.size(); position++)
+            {
+                if (compare(m_heap[position], m_heap[first]) < 0)
+                {
+                    first = position;
+                }
+            }
+        }
+        return m_heap[first];
+    }
+
+    void clear()
+    {
+        m_heap.clear();
+        m_taken.clear();
+        m_ordered = false;
+    }
+
+    template<class Compare>
+    void push(const Entry & value, Compare compare)
+    {
+        m_heap.push_back(value);
+        if (m_ordered)
+        {
+            sift_up(m_heap.size() - 1, compare);
+        }
+        else if (m_heap.size() > LINEAR_LIMIT && !m_scanning)
+        {
+            heapify(compare);
+        }
+    }
+
+    // Writes the streams at the first key to matches and returns how many there are.
+    // They must be given back with replace_taken() before anything else is done to the heap.
+    template<class Compare>
+    size_t take_first(Entry * matches, Compare compare)
+    {
+        m_taken.clear();
+        if (m_heap.empty())
+        {
+            return 0;
+        }
+
+        m_taken.push_back(0);
+        if (!m_ordered)
+        {
+            for (size_t position = 1; position < m_heap.size(); position++)
+            {
+                const int comparison = compare(m_heap[position], m_heap[m_taken[0]]);
+                if (comparison < 0)
+                {
+                    m_taken.assign(1, position);
+                }
+                else if (comparison == 0)
+                {
+                    m_taken.push_back(position);
+                }
+            }
+            for (size_t i = 0; i < m_taken.size(); i++)
+            {
+                matches[i] = m_heap[m_taken[i]];
+            }
+            return m_taken.size();
+        }
+
+        // Nothing comes before the front, so a child that does not come after it is equal, and so is taken too.
+        for (size_t i = 0; i < m_taken.size(); i++)
+        {
+            const size_t position = m_taken[i];
+            matches[i] = m_heap[position];
+            for (size_t child = 2 * position + 1; child <= 2 * position + 2 && child < m_heap.size(); child++)
+            {
+                if (compare(m_heap[child], m_heap[0]) <= 0)
+                {
+                    m_taken.push_back(child);
+                }
+            }
+        }
+        return m_taken.size();
+    }
+
+    // advance(entry) moves a taken stream on to its next key (updating entry if it caches the key), or returns false
+    // to have it dropped from the heap.
+    template<class Advance, class Compare>
+    void replace_taken(Advance advance, Compare compare)
+    {
+        // Once more than a quarter of the streams are taken, they are left unordered until fewer than an eighth are.
+        // The gap between the two keeps a heap from being rebuilt over and over as the overlap varies.
+        const size_t n_taken = m_taken.size();
+        if (m_ordered && n_taken * 4 > m_heap.size())
+        {
+            m_ordered = false;
+            m_scanning = true;
+        }
+
+        // Deepest first, so that the children of each position are already heaps when it is reached. What is moved
+        // from the end to fill a dropped stream's place comes from further down, so it is already in order.
+        for (size_t i = n_taken; i > 0; i--)
+        {
+            const size_t position = m_taken[i - 1];
+            if (!advance(m_heap[position]))
+            {
+                m_heap[position] = m_heap.back();
+                m_heap.pop_back();
+                if (position == m_heap.size())
+                {
+                    continue;
+                }
+            }
+            if (m_ordered)
+            {
+                sift_down(position, compare);
+            }
+        }
+        m_taken.clear();
+
+        if (m_heap.size() <= LINEAR_LIMIT)
+        {
+            m_ordered = false;
+        }
+        else if (!m_ordered && n_taken * 8 < m_heap.size())
+        {
+            heapify(compare);
+            m_scanning = false;
+        }
+    }
+};
+
+#endif /* MergeHeap_hpp */
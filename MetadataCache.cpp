@@ -0,0 +1,262 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  MetadataCache.cpp
+//  Keeps what was learnt about each SSTable on disk, so that later runs over the same files need not learn it again.
+
+#include "MetadataCache.hpp"
+#include "Buffer.hpp"
+#include "Partitioners.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The format is big endian throughout, like the SSTable components, so that it is read with the same buffers.
+// Changing the layout means changing the version, so that old files are ignored rather than misread.
+static const int32_t CACHE_MAGIC = 0x43324d43; // "C2MC"
+static const int32_t CACHE_VERSION = 1;
+static const int32_t CACHE_END = 0x454e4421;   // "END!", so that a truncated file is never taken for a whole one
+static const char CACHE_SUFFIX[] = ".meta";
+
+std::string MetadataCache::s_directory;
+
+// Files are named after their table, with a hash of the full path in case tables in different directories share a name.
+static std::string cache_file_name(const std::string & directory, const std::string & path)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : path)
+    {
+        hash ^= uint8_t(c);
+        hash *= 1099511628211ULL;
+    }
+
+    const size_t slash = path.rfind('/');
+    const std::string base = slash == std::string::npos ? path : path.substr(slash + 1);
+    char hash_string[17];
+    snprintf(hash_string, sizeof(hash_string), "%016llx", (unsigned long long)hash);
+    return directory + '/' + base + '-' + hash_string + CACHE_SUFFIX;
+}
+
+namespace
+{
+    class CacheWriter
+    {
+        std::string m_bytes;
+    public:
+        void write_int(int32_t value)
+        {
+            for (int shift = 24; shift >= 0; shift -= 8)
+                m_bytes.push_back(char(uint32_t(value) >> shift));
+        }
+        void write_longlong(int64_t value)
+        {
+            for (int shift = 56; shift >= 0; shift -= 8)
+                m_bytes.push_back(char(uint64_t(value) >> shift));
+        }
+        void write_string(const std::string & value)
+        {
+            write_int(int32_t(value.size()));
+            m_bytes.append(value);
+        }
+        void write_columns(const std::vector<std::pair<std::string, TableSchema::ColumnFormat>> & columns)
+        {
+            write_int(int32_t(columns.size()));
+            for (const auto & column : columns)
+            {
+                write_string(column.first);
+                write_int(column.second);
+            }
+        }
+        const std::string & bytes() const { return m_bytes; }
+    };
+}
+
+// Returns false if the string runs past the end of the file.
+static bool read_string(Buffer & buf, std::string & value)
+{
+    const int32_t len = buf.read_int();
+    const uint8_t * data = len > 0 ? buf.read_bytes(len) : nullptr;
+    if (len < 0 || (len > 0 && data == nullptr))
+    {
+        return false;
+    }
+    value.assign(reinterpret_cast<const char *>(data), len);
+    return true;
+}
+
+static bool read_format(Buffer & buf, TableSchema::ColumnFormat & format)
+{
+    const int32_t value = buf.read_int();
+    if (value < TableSchema::COLUMN_TEXT || value > TableSchema::COLUMN_UNKNOWN)
+    {
+        return false;
+    }
+    format = TableSchema::ColumnFormat(value);
+    return true;
+}
+
+static bool read_columns(Buffer & buf, std::vector<std::pair<std::string, TableSchema::ColumnFormat>> & columns)
+{
+    // The entries are added as they are read, so that a corrupt count cannot ask for more memory than the file has.
+    const int32_t n_columns = buf.read_int();
+    columns.clear();
+    for (int32_t i = 0; i < n_columns; i++)
+    {
+        columns.emplace_back();
+        if (!read_string(buf, columns.back().first) || !read_format(buf, columns.back().second))
+        {
+            return false;
+        }
+    }
+    return !buf.is_eof();
+}
+
+bool MetadataCache::load(const std::string & path, const struct stat & data_stat, TableMetadata & metadata)
+{
+    if (!is_enabled())
+    {
+        return false;
+    }
+
+    std::unique_ptr<Buffer> file = Buffer::open_file(cache_file_name(s_directory, path).c_str(), true);
+    Buffer & buf = *file;
+    if (!buf.good() || buf.read_int() != CACHE_MAGIC || buf.read_int() != CACHE_VERSION)
+    {
+        return false;
+    }
+
+    std::string cached_path;
+    if (!read_string(buf, cached_path) || cached_path != path ||
+        buf.read_longlong() != int64_t(data_stat.st_size) ||
+        buf.read_longlong() != int64_t(data_stat.st_mtime) ||
+        buf.read_longlong() != int64_t(data_stat.st_ino))
+    {
+        return false;
+    }
+
+    const int32_t flags = buf.read_int();
+    metadata.compressed = (flags & 1) != 0;
+    metadata.has_statistics = (flags & 2) != 0;
+    metadata.digest_verified = (flags & 4) != 0;
+
+    std::string partitioner_name;
+    if (!read_string(buf, partitioner_name))
+    {
+        return false;
+    }
+    metadata.partitioner = partitioner_name.empty() ? nullptr : Partitioner::partitioner_from_name(partitioner_name.c_str());
+    if (!partitioner_name.empty() && metadata.partitioner == nullptr)
+    {
+        return false;
+    }
+
+    metadata.stats.minTimestamp = buf.read_longlong();
+    metadata.stats.minTTL = buf.read_longlong();
+
+    if (!read_format(buf, metadata.schema.keyType))
+    {
+        return false;
+    }
+    const int32_t n_clustering = buf.read_int();
+    metadata.schema.clustering.clear();
+    for (int32_t i = 0; i < n_clustering; i++)
+    {
+        TableSchema::ColumnFormat format;
+        if (!read_format(buf, format))
+        {
+            return false;
+        }
+        metadata.schema.clustering.push_back(format);
+    }
+    if (!read_columns(buf, metadata.schema.static_columns) ||
+        !read_columns(buf, metadata.schema.regular_columns))
+    {
+        return false;
+    }
+
+    return read_string(buf, metadata.first_key) &&
+           read_string(buf, metadata.last_key) &&
+           buf.read_int() == CACHE_END &&
+           !buf.is_eof();
+}
+
+// Failing to write the cache is not fatal; the metadata is just read again next time.
+void MetadataCache::store(const std::string & path, const struct stat & data_stat, const TableMetadata & metadata)
+{
+    if (!is_enabled())
+    {
+        return;
+    }
+
+    CacheWriter writer;
+    writer.write_int(CACHE_MAGIC);
+    writer.write_int(CACHE_VERSION);
+    writer.write_string(path);
+    writer.write_longlong(data_stat.st_size);
+    writer.write_longlong(data_stat.st_mtime);
+    writer.write_longlong(data_stat.st_ino);
+    writer.write_int((metadata.compressed ? 1 : 0) | (metadata.has_statistics ? 2 : 0) | (metadata.digest_verified ? 4 : 0));
+    writer.write_string(metadata.partitioner ? metadata.partitioner->name() : std::string());
+    writer.write_longlong(metadata.stats.minTimestamp);
+    writer.write_longlong(metadata.stats.minTTL);
+    writer.write_int(metadata.schema.keyType);
+    writer.write_int(int32_t(metadata.schema.clustering.size()));
+    for (TableSchema::ColumnFormat format : metadata.schema.clustering)
+    {
+        writer.write_int(format);
+    }
+    writer.write_columns(metadata.schema.static_columns);
+    writer.write_columns(metadata.schema.regular_columns);
+    writer.write_string(metadata.first_key);
+    writer.write_string(metadata.last_key);
+    writer.write_int(CACHE_END);
+
+    // Written under a temporary name and renamed, so that another run never sees half a file.
+    const std::string file_name = cache_file_name(s_directory, path);
+    std::string temp_name = file_name + ".XXXXXX";
+    const int fd = mkstemp(&temp_name[0]);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Warning: cannot create metadata cache file %s: %s\n", temp_name.c_str(), strerror(errno));
+        return;
+    }
+
+    // mkstemp() makes the file private, but the metadata is no more secret than the tables it describes.
+    fchmod(fd, 0644);
+
+    const std::string & bytes = writer.bytes();
+    size_t written = 0;
+    while (written < bytes.size())
+    {
+        const ssize_t result = write(fd, bytes.data() + written, bytes.size() - written);
+        if (result <= 0)
+        {
+            break;
+        }
+        written += result;
+    }
+    close(fd);
+
+    if (written != bytes.size() || rename(temp_name.c_str(), file_name.c_str()) != 0)
+    {
+        fprintf(stderr, "Warning: cannot write metadata cache file %s: %s\n", file_name.c_str(), strerror(errno));
+        unlink(temp_name.c_str());
+    }
+}
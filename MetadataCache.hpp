@@ -0,0 +1,66 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  MetadataCache.hpp
+//  Keeps what was learnt about each SSTable on disk, so that later runs over the same files need not learn it again.
+
+#ifndef MetadataCache_hpp
+#define MetadataCache_hpp
+
+#include "SSTableSchema.hpp"
+
+#include <string>
+
+#include <sys/stat.h>
+
+class Partitioner;
+
+// Everything about a table that is read before merging it, apart from where it is.
+struct TableMetadata
+{
+    TableMetadata() : compressed(false), has_statistics(false), digest_verified(false), partitioner(nullptr) {}
+    bool compressed;
+    bool has_statistics;
+    // Whether the data file has been checked against its digest, which is skipped while checksums are disabled.
+    bool digest_verified;
+    const Partitioner * partitioner;
+    EncodingStats stats;
+    TableSchema schema;
+    // The first and last keys in the table, from Summary.db. Empty for formats before KA.
+    std::string first_key;
+    std::string last_key;
+};
+
+// There is one cache file per SSTable. It is only used while the data file has the same size and modification time
+// as when it was written, as SSTables are never changed once they are complete.
+class MetadataCache
+{
+    static std::string s_directory;
+public:
+    // Nothing is cached unless a directory is given.
+    static void set_directory(const char * directory)
+    {
+        s_directory = directory;
+    }
+    static bool is_enabled()
+    {
+        return !s_directory.empty();
+    }
+
+    // path is the table's files' common prefix, and data_stat describes its data file.
+    static bool load(const std::string & path, const struct stat & data_stat, TableMetadata & metadata);
+    static void store(const std::string & path, const struct stat & data_stat, const TableMetadata & metadata);
+};
+
+#endif /* MetadataCache_hpp */
@@ -17,6 +17,7 @@
 
 #include "Partitioners.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <limits>
 
@@ -25,52 +26,221 @@ extern "C"
 #include <openssl/md5.h>
 }
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_MD5
+#include <immintrin.h>
+#endif
+
+void Partitioner::assign_tokens(CassandraParser::Token * tokens, const StringView * keys, size_t n_keys) const
+{
+    for (size_t i = 0; i < n_keys; i++)
+    {
+        assign_token(tokens[i], keys[i].data(), keys[i].size());
+    }
+}
+
+#ifdef HAVE_X86_MD5
+
+static const size_t MD5_LANES = 8;
+static const size_t MD5_BLOCK_SIZE = 64;
+static const size_t MD5_MAX_BLOCKS = 4;
+// The longest key that fits MD5_MAX_BLOCKS once it is padded and the length is appended.
+static const size_t MD5_MAX_LANE_KEY = MD5_MAX_BLOCKS * MD5_BLOCK_SIZE - 9;
+
+// MD5 of up to eight keys at once, one in each 32 bit lane of an AVX2 register (as in Intel's multi-buffer hashing).
+// Each lane stops taking on new state once it has run out of blocks. Keys must be no longer than MD5_MAX_LANE_KEY.
+__attribute__((target("avx2")))
+static void md5_x8(uint8_t (*digests)[16], const StringView * keys, size_t n_keys)
+{
+    static const uint32_t K[64] =
+    {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+    };
+    static const int SHIFTS[4][4] = { { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 } };
+
+    // The padded keys, one after another.
+    uint32_t words[MD5_LANES][MD5_MAX_BLOCKS * MD5_BLOCK_SIZE / 4];
+    int32_t n_blocks[MD5_LANES] = { 0 };
+    size_t max_blocks = 0;
+    for (size_t lane = 0; lane < n_keys; lane++)
+    {
+        uint8_t * bytes = reinterpret_cast<uint8_t *>(words[lane]);
+        const size_t size = keys[lane].size();
+        const size_t blocks = (size + 8) / MD5_BLOCK_SIZE + 1;
+        std::memcpy(bytes, keys[lane].data(), size);
+        bytes[size] = 0x80;
+        std::memset(bytes + size + 1, 0, blocks * MD5_BLOCK_SIZE - size - 9);
+        const uint64_t bits = uint64_t(size) * 8;
+        std::memcpy(bytes + blocks * MD5_BLOCK_SIZE - 8, &bits, 8);
+        n_blocks[lane] = int32_t(blocks);
+        max_blocks = std::max(max_blocks, blocks);
+    }
+
+    const __m256i ones = _mm256_set1_epi32(-1);
+    const __m256i lane_base = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i lane_words = _mm256_mullo_epi32(lane_base, _mm256_set1_epi32(int(sizeof(words[0]) / 4)));
+    const __m256i lane_blocks = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(n_blocks));
+
+    __m256i a = _mm256_set1_epi32(0x67452301);
+    __m256i b = _mm256_set1_epi32(int(0xefcdab89));
+    __m256i c = _mm256_set1_epi32(int(0x98badcfe));
+    __m256i d = _mm256_set1_epi32(0x10325476);
+
+    for (size_t block = 0; block < max_blocks; block++)
+    {
+        __m256i w[16];
+        for (int i = 0; i < 16; i++)
+        {
+            const __m256i index = _mm256_add_epi32(lane_words, _mm256_set1_epi32(int(block * 16 + i)));
+            w[i] = _mm256_i32gather_epi32(reinterpret_cast<const int *>(words), index, 4);
+        }
+
+        __m256i aa = a, bb = b, cc = c, dd = d;
+        for (int i = 0; i < 64; i++)
+        {
+            __m256i f;
+            int g;
+            switch (i / 16)
+            {
+                case 0:
+                    f = _mm256_or_si256(_mm256_and_si256(bb, cc), _mm256_andnot_si256(bb, dd));
+                    g = i;
+                    break;
+                case 1:
+                    f = _mm256_or_si256(_mm256_and_si256(dd, bb), _mm256_andnot_si256(dd, cc));
+                    g = (5 * i + 1) % 16;
+                    break;
+                case 2:
+                    f = _mm256_xor_si256(_mm256_xor_si256(bb, cc), dd);
+                    g = (3 * i + 5) % 16;
+                    break;
+                default:
+                    f = _mm256_xor_si256(cc, _mm256_or_si256(bb, _mm256_xor_si256(dd, ones)));
+                    g = (7 * i) % 16;
+                    break;
+            }
+            f = _mm256_add_epi32(_mm256_add_epi32(f, aa), _mm256_add_epi32(_mm256_set1_epi32(int(K[i])), w[g]));
+            const int shift = SHIFTS[i / 16][i % 4];
+            f = _mm256_or_si256(_mm256_sllv_epi32(f, _mm256_set1_epi32(shift)), _mm256_srlv_epi32(f, _mm256_set1_epi32(32 - shift)));
+            aa = dd;
+            dd = cc;
+            cc = bb;
+            bb = _mm256_add_epi32(bb, f);
+        }
+
+        // Lanes that have already had all their blocks keep the state they finished with.
+        const __m256i active = _mm256_cmpgt_epi32(lane_blocks, _mm256_set1_epi32(int(block)));
+        a = _mm256_blendv_epi8(a, _mm256_add_epi32(a, aa), active);
+        b = _mm256_blendv_epi8(b, _mm256_add_epi32(b, bb), active);
+        c = _mm256_blendv_epi8(c, _mm256_add_epi32(c, cc), active);
+        d = _mm256_blendv_epi8(d, _mm256_add_epi32(d, dd), active);
+    }
+
+    uint32_t state[4][MD5_LANES];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(state[0]), a);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(state[1]), b);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(state[2]), c);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(state[3]), d);
+    for (size_t lane = 0; lane < n_keys; lane++)
+    {
+        for (size_t word = 0; word < 4; word++)
+        {
+            std::memcpy(digests[lane] + word * 4, &state[word][lane], 4);
+        }
+    }
+}
+
+static bool has_avx2()
+{
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+#endif // HAVE_X86_MD5
+
 class RandomPartitioner : public Partitioner
 {
+    // The token is the MD5 digest read as a signed big endian integer, made positive.
+    static void token_from_digest(CassandraParser::Token & token, const uint8_t * checksum)
+    {
+        token.high = 0;
+        token.low = 0;
+        for (size_t i = 0; i < sizeof(uint64_t); i++)
+        {
+            token.high = (token.high << 8) | checksum[i];
+            token.low = (token.low << 8) | checksum[i + sizeof(uint64_t)];
+        }
+
+        if (token.high >> 63)
+        {
+            // Doing a absolute value of MD5 treated as twos compliment
+            token.low = ~token.low + 1;
+            token.high = ~token.high + (token.low == 0 ? 1 : 0);
+        }
+    }
+
 public:
     virtual void assign_token(CassandraParser::Token & token, const char * key, size_t key_length) const
     {
-        CassandraParser::Token checksum;
+        uint8_t checksum[MD5_DIGEST_LENGTH];
         MD5_CTX md5;
         MD5_Init(&md5);
         MD5_Update(&md5, key, key_length);
         MD5_Final(checksum, &md5);
+        token_from_digest(token, checksum);
+    }
 
-        if (checksum[0] < 0x80)
-        {
-            std::memcpy(token, checksum, sizeof(CassandraParser::Token));
-        }
-        else
+    virtual void assign_tokens(CassandraParser::Token * tokens, const StringView * keys, size_t n_keys) const
+    {
+#ifdef HAVE_X86_MD5
+        // A few keys are quicker one at a time than spread over all eight lanes.
+        if (n_keys >= MD5_LANES / 2 && has_avx2())
         {
-            // Doing a absolute value of MD5 treated as twos compliment
-            int i = 15;
-            while(checksum[i] == 0) // Mustn't match first byte, due to condition above
-            {
-                token[i] = 0;
-                i--;
-            }
-
-            token[i] = 0xFF - checksum[i] + 1;
-            i--;
-
-            for (; i >= 0; i--)
+            while (n_keys > 0)
             {
-                token[i] = 0xFF - checksum[i];
+                const size_t n_lanes = std::min(n_keys, MD5_LANES);
+                bool fits = true;
+                for (size_t i = 0; i < n_lanes; i++)
+                {
+                    fits = fits && keys[i].size() <= MD5_MAX_LANE_KEY;
+                }
+
+                if (fits)
+                {
+                    uint8_t digests[MD5_LANES][16];
+                    md5_x8(digests, keys, n_lanes);
+                    for (size_t i = 0; i < n_lanes; i++)
+                    {
+                        token_from_digest(tokens[i], digests[i]);
+                    }
+                }
+                else
+                {
+                    Partitioner::assign_tokens(tokens, keys, n_lanes);
+                }
+                tokens += n_lanes;
+                keys += n_lanes;
+                n_keys -= n_lanes;
             }
+            return;
         }
+#endif
+        Partitioner::assign_tokens(tokens, keys, n_keys);
     }
 
-    virtual int compare_token(const CassandraParser::Token & tokenA, const std::string & keyA, const CassandraParser::Token & tokenB, const std::string & keyB) const
+    virtual bool split_token(CassandraParser::Token & boundary, size_t index, size_t n_ranges) const
     {
-        const int result = std::memcmp(tokenA, tokenB, 16);
-        if (result != 0)
-            return result;
-
-        const int content_cmp = std::memcmp(keyA.data(), keyB.data(), std::min(keyA.size(), keyB.size()));
-        if (content_cmp)
-            return content_cmp;
-
-        return int(keyA.size()) - int(keyB.size());
+        // Tokens run from 0 to 2^127. Splitting on the top 64 bits is precise enough.
+        boundary.high = ((uint64_t(1) << 63) / n_ranges) * index;
+        boundary.low = 0;
+        return true;
     }
 };
 
@@ -91,19 +261,27 @@ public:
         return k;
     }
 
+    // Flips the sign bit, so that the tokens sort as unsigned integers in the same order as they did signed.
+    static uint64_t to_unsigned_order(int64_t token)
+    {
+        return uint64_t(token) ^ (uint64_t(1) << 63);
+    }
+
     static int64_t rotl64(int64_t v, int32_t n)
     {
         return ((v << n) | ((uint64_t)v >> (64 - n)));
     }
 
+    // The body's blocks are read as unsigned little endian words, as in the reference implementation.
+    // (Only the tail is read with Java's signed bytes.)
     static int64_t getblock(const char * key, int offset, int index)
     {
-        int i_8 = index << 3;
-        int blockOffset = offset + i_8;
-        return ((int64_t) key[blockOffset + 0] & 0xff) + (((int64_t) key[blockOffset + 1] & 0xff) << 8) +
-        (((int64_t) key[blockOffset + 2] & 0xff) << 16) + (((int64_t) key[blockOffset + 3] & 0xff) << 24) +
-        (((int64_t) key[blockOffset + 4] & 0xff) << 32) + (((int64_t) key[blockOffset + 5] & 0xff) << 40) +
-        (((int64_t) key[blockOffset + 6] & 0xff) << 48) + (((int64_t) key[blockOffset + 7] & 0xff) << 56);
+        uint64_t block;
+        std::memcpy(&block, key + offset + (index << 3), sizeof(block));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        block = __builtin_bswap64(block);
+#endif
+        return int64_t(block);
     }
 
     virtual void assign_token(CassandraParser::Token & token, const char * key, size_t length) const
@@ -184,27 +362,17 @@ public:
         if (h1 == std::numeric_limits<int64_t>::min())
             h1 = std::numeric_limits<int64_t>::max();
 
-        for (size_t i = 0; i < sizeof(int64_t); i++)
-        {
-            token[i] = ((char *)&h1)[i];
-        }
+        token.high = to_unsigned_order(h1);
+        token.low = 0;
     }
 
-    virtual int compare_token(const CassandraParser::Token & tokenA, const std::string & keyA, const CassandraParser::Token & tokenB, const std::string & keyB) const
+    virtual bool split_token(CassandraParser::Token & boundary, size_t index, size_t n_ranges) const
     {
-        const int64_t resultA = *reinterpret_cast<const int64_t *>(&tokenA);
-        const int64_t resultB = *reinterpret_cast<const int64_t *>(&tokenB);
-        // To prevent wrap around, use comparisons here
-        if (resultA < resultB)
-            return -1;
-        else if (resultA > resultB)
-            return 1;
-
-        const int content_cmp = std::memcmp(keyA.data(), keyB.data(), std::min(keyA.size(), keyB.size()));
-        if (content_cmp)
-            return content_cmp;
-
-        return int(keyA.size()) - int(keyB.size());
+        // Tokens cover the whole range of int64_t
+        const uint64_t step = std::numeric_limits<uint64_t>::max() / n_ranges;
+        boundary.high = to_unsigned_order(int64_t(uint64_t(std::numeric_limits<int64_t>::min()) + step * index));
+        boundary.low = 0;
+        return true;
     }
 };
 
@@ -214,14 +382,8 @@ class ByteOrderPartitioner : public Partitioner
 public:
     virtual void assign_token(CassandraParser::Token & token, const char * key, size_t key_length) const
     {
-    }
-
-    virtual int compare_token(const CassandraParser::Token & tokenA, const std::string & keyA, const CassandraParser::Token & tokenB, const std::string & keyB) const
-    {
-        const int content_cmp = std::memcmp(keyA.data(), keyB.data(), std::min(keyA.size(), keyB.size()));
-        if (content_cmp)
-            return content_cmp;
-        return int(keyA.size()) - int(keyB.size());
+        token.high = 0;
+        token.low = 0;
     }
 };
 
@@ -231,11 +393,8 @@ class OrderPreservingPartitioner : public Partitioner
 public:
     virtual void assign_token(CassandraParser::Token & token, const char * key, size_t key_length) const
     {
-    }
-
-    virtual int compare_token(const CassandraParser::Token & tokenA, const std::string & keyA, const CassandraParser::Token & tokenB, const std::string & keyB) const
-    {
-        return keyA.compare(keyB);
+        token.high = 0;
+        token.low = 0;
     }
 };
 
@@ -244,26 +403,27 @@ static ByteOrderPartitioner       byteOrderPartitioner;
 static OrderPreservingPartitioner orderPreservingPartitioner;
 static Murmer3Partitioner         murmer3Partitioner;
 
-const Partitioner * Partitioner::partitioner_from_name(const char * partitionerIdentifier)
+static const Partitioner * const partitioners[] =
 {
-    const Partitioner * const partitioners[] =
-    {
-        &randomPartitioner,
-        &byteOrderPartitioner,
-        &orderPreservingPartitioner,
-        &murmer3Partitioner,
-        nullptr
-    };
-    const char * const partitioner_names[] =
-    {
-        "RandomPartitioner",
-        "ByteOrderedPartitioner",
-        "OrderPreservingPartitioner",
-        "Murmur3Partitioner",
-        nullptr
-    };
+    &randomPartitioner,
+    &byteOrderPartitioner,
+    &orderPreservingPartitioner,
+    &murmer3Partitioner,
+    nullptr
+};
+static const char * const partitioner_names[] =
+{
+    "RandomPartitioner",
+    "ByteOrderedPartitioner",
+    "OrderPreservingPartitioner",
+    "Murmur3Partitioner",
+    nullptr
+};
 
-    constexpr char partitionerPrefix[] = "org.apache.cassandra.dht.";
+constexpr char partitionerPrefix[] = "org.apache.cassandra.dht.";
+
+const Partitioner * Partitioner::partitioner_from_name(const char * partitionerIdentifier)
+{
     constexpr size_t prefixLen = sizeof(partitionerPrefix) - 1;
     if (std::strncmp(partitionerIdentifier, partitionerPrefix, prefixLen) == 0)
     {
@@ -280,6 +440,18 @@ const Partitioner * Partitioner::partitioner_from_name(const char * partitionerI
     return nullptr;
 }
 
+std::string Partitioner::name() const
+{
+    for (int i = 0; partitioners[i] != nullptr; i++)
+    {
+        if (partitioners[i] == this)
+        {
+            return std::string(partitionerPrefix) + partitioner_names[i];
+        }
+    }
+    return std::string();
+}
+
 // Ancient versions of Cassandra only have the random partitioner, so this is the default
 // Returns the partitioner called "RandomPartitioner". Does not return a partitioner at random.
 const Partitioner * Partitioner::random_partitioner()
@@ -24,10 +24,28 @@ class Partitioner
 {
 public:
     virtual void assign_token(CassandraParser::Token & token, const char * key, size_t key_length) const = 0;
-    virtual int compare_token(const CassandraParser::Token & tokenA, const std::string & keyA, const CassandraParser::Token & tokenB, const std::string & keyB) const = 0;
+    // Assigns tokens[i] for each of keys[i]. Some partitioners can hash several keys at once.
+    virtual void assign_tokens(CassandraParser::Token * tokens, const StringView * keys, size_t n_keys) const;
+    // Rows are in order of token, then key. Given how tokens are kept, this is the same for every partitioner.
+    static int compare_token(const CassandraParser::Token & tokenA, const StringView & keyA, const CassandraParser::Token & tokenB, const StringView & keyB)
+    {
+        if (tokenA.high != tokenB.high)
+            return tokenA.high < tokenB.high ? -1 : 1;
+        if (tokenA.low != tokenB.low)
+            return tokenA.low < tokenB.low ? -1 : 1;
+        return keyA.compare(keyB);
+    }
+    // Writes the index'th of the boundaries that divide the token ring into n_ranges equal parts.
+    // Returns false if this partitioner does not distribute keys evenly, so the ring cannot be split.
+    virtual bool split_token(CassandraParser::Token & boundary, size_t index, size_t n_ranges) const
+    {
+        return false;
+    }
     virtual ~Partitioner() {}
     
     static const Partitioner * partitioner_from_name(const char * partitionerIdentifier);
+    // The name that partitioner_from_name() takes.
+    std::string name() const;
     static const Partitioner * random_partitioner();
 };
 
@@ -19,12 +19,14 @@
 #include "Partitioners.hpp"
 
 #include <assert.h>
+#include <unistd.h>
 
 #include <cstring>
 #include <limits>
 
 #define VERSION_STRING_TO_VERSION(a, b) (((a - 'a') * 26 + (b - 'a')))
 
+#define VERSION_NA VERSION_STRING_TO_VERSION('n', 'a')
 #define VERSION_MA VERSION_STRING_TO_VERSION('m', 'a')
 #define VERSION_LA VERSION_STRING_TO_VERSION('l', 'a')
 #define VERSION_KA VERSION_STRING_TO_VERSION('k', 'a')
@@ -41,10 +43,48 @@ const char INDEX_SUFFIX[] = "-Index.db";
 const char SUMMARY_SUFFIX[] = "-Summary.db";
 const char COMPRESSION_INFO_SUFFIX[] = "-CompressionInfo.db";
 const char DATA_SUFFIX[] = "-Data.db";
+const char CRC_SUFFIX[] = "-CRC.db";
+const char DIGEST_CRC32_SUFFIX[] = "-Digest.crc32";
+const char DIGEST_ADLER32_SUFFIX[] = "-Digest.adler32";
+
+// Checksums of uncompressed tables were Adler32 from ka until ma, and CRC32 otherwise.
+static Buffer::ChecksumClass uncompressed_checksum_class(int version)
+{
+    return (version >= VERSION_KA && version < VERSION_MA) ? Buffer::ADLER32 : Buffer::CRC32;
+}
+
+bool SStable::is_compressed(const std::string & path)
+{
+    return access((path + COMPRESSION_INFO_SUFFIX).c_str(), F_OK) == 0;
+}
+
+std::shared_ptr<const CompressionInfo> SStable::load_compression_info(const std::string & path, int version)
+{
+    return CompressionInfo::load((path + COMPRESSION_INFO_SUFFIX).c_str(), version >= VERSION_NA);
+}
+
+bool SStable::verify_digest(const TableConfig & config)
+{
+    if (config.compressed)
+    {
+        return true;
+    }
+
+    const Buffer::ChecksumClass checksumClass = uncompressed_checksum_class(config.version);
+    return UncompressedDataBuffer::verify_digest((config.path + DATA_SUFFIX).c_str(),
+                                                 (config.path + CRC_SUFFIX).c_str(),
+                                                 (config.path + (checksumClass == Buffer::CRC32 ? DIGEST_CRC32_SUFFIX : DIGEST_ADLER32_SUFFIX)).c_str(),
+                                                 checksumClass);
+}
+
+bool SStable::has_schema(int version)
+{
+    return version >= VERSION_MA;
+}
 
 std::unique_ptr<SStable> SStable::create_table(const TableConfig & config)
 {
-    if (config.version >= VERSION_MA)
+    if (has_schema(config.version))
     {
         return std::unique_ptr<SStable>(new NewSStable(config));
     }
@@ -57,36 +97,79 @@ std::unique_ptr<SStable> SStable::create_table(const TableConfig & config)
 
 bool SStable::init_at_key(const Partitioner & partitioner, const CassandraParser::Token & first_token, const std::string & first_key)
 {
-    UncompressedBuffer index_buffer((config.path + INDEX_SUFFIX).c_str());
+    // A table that ends before the key has nothing to offer, and its index need not be searched.
+    if (!config.last_key.empty())
+    {
+        CassandraParser::Token last_token;
+        partitioner.assign_token(last_token, config.last_key.data(), config.last_key.length());
+        if (Partitioner::compare_token(first_token, first_key, last_token, config.last_key) > 0)
+        {
+            return false;
+        }
+    }
+
+    std::unique_ptr<Buffer> index_file = Buffer::open_file((config.path + INDEX_SUFFIX).c_str(), false);
+    Buffer & index_buffer = *index_file;
     if (!index_buffer.good())
     {
         return false;
     }
 
     int64_t found;
-    if (find_partition_in_summary(found, partitioner, config.path, first_token, first_key))
+    if (find_partition_in_summary(found, partitioner, first_token, first_key))
     {
         index_buffer.seek(found);
     }
 
-    // Now use the index to find the key we are looking for
+    // Now use the index to find the key we are looking for.
+    // The keys are read a few at a time, so that the partitioner can hash them together.
+    const size_t BATCH_SIZE = 8;
+    std::string keys[BATCH_SIZE];
+    StringView key_views[BATCH_SIZE];
+    int64_t offsets[BATCH_SIZE];
+    CassandraParser::Token tokens[BATCH_SIZE];
     while (!index_buffer.is_eof())
     {
-        next_key_value = index_buffer.read_string();
-        start_offset = config.version >= VERSION_MA ? index_buffer.read_unsigned_vint() : index_buffer.read_longlong();
-        partitioner.assign_token(next_token_value, next_key_value.data(), next_key_value.length());
-        if (partitioner.compare_token(first_token, first_key, next_token_value, next_key_value) <= 0)
+        size_t n_keys = 0;
+        while (n_keys < BATCH_SIZE)
         {
-            return true;
+            const StringView key = index_buffer.read_string_view();
+            keys[n_keys].assign(key.data(), key.size());
+            offsets[n_keys] = config.version >= VERSION_MA ? index_buffer.read_unsigned_vint() : index_buffer.read_longlong();
+            // The end of the file is only noticed by trying to read past it, so that attempt is not an entry.
+            if (index_buffer.is_eof())
+            {
+                break;
+            }
+            uint64_t to_skip = config.version >= VERSION_MA ? index_buffer.read_unsigned_vint() : index_buffer.read_int();
+            index_buffer.skip_bytes(to_skip);
+            key_views[n_keys] = keys[n_keys];
+            n_keys++;
         }
 
-        uint64_t to_skip = config.version >= VERSION_MA ? index_buffer.read_unsigned_vint() : index_buffer.read_int();
-        index_buffer.skip_bytes(to_skip);
+        partitioner.assign_tokens(tokens, key_views, n_keys);
+        for (size_t i = 0; i < n_keys; i++)
+        {
+            if (Partitioner::compare_token(first_token, first_key, tokens[i], keys[i]) <= 0)
+            {
+                next_key_value.swap(keys[i]);
+                start_offset = offsets[i];
+                next_token_value = tokens[i];
+                return true;
+            }
+        }
     }
     return false;
 }
 bool SStable::init(const Partitioner & partitioner)
 {
+    if (!config.first_key.empty())
+    {
+        next_key_value = config.first_key;
+        partitioner.assign_token(next_token_value, next_key_value.data(), next_key_value.length());
+        return true;
+    }
+
     if (open())
     {
         read_row(&partitioner);
@@ -99,10 +182,21 @@ bool SStable::init(const Partitioner & partitioner)
 
 bool SStable::open()
 {
-    const CompressedBuffer::ChecksumClass checksumClass = (config.version >= VERSION_JB && config.version < VERSION_MA) ? CompressedBuffer::ADLER32 : CompressedBuffer::CRC32;
-    data_buffer = std::make_shared<CompressedBuffer>((config.path + DATA_SUFFIX).c_str(),
-                                                     (config.path + COMPRESSION_INFO_SUFFIX).c_str(),
-                                                     checksumClass, config.version >= VERSION_JB);
+    if (config.compressed)
+    {
+        std::call_once(*config.compression_info_loaded, [this]()
+        {
+            config.compression_info = load_compression_info(config.path, config.version);
+        });
+        const CompressedBuffer::ChecksumClass checksumClass = (config.version >= VERSION_JB && config.version < VERSION_MA) ? CompressedBuffer::ADLER32 : CompressedBuffer::CRC32;
+        data_buffer = std::make_shared<CompressedBuffer>((config.path + DATA_SUFFIX).c_str(), config.compression_info,
+                                                         checksumClass, config.version >= VERSION_JB);
+    }
+    else
+    {
+        data_buffer = UncompressedDataBuffer::open((config.path + DATA_SUFFIX).c_str(), (config.path + CRC_SUFFIX).c_str(),
+                                                   uncompressed_checksum_class(config.version));
+    }
     data_buffer->seek(start_offset);
 
     fsm = READ_ROW;
@@ -116,67 +210,133 @@ void SStable::close()
     data_buffer.reset();
 }
 
-// The summery is a seperate buffer that records a small subset of keys in order to find a starting position
-// in the index faster.
-// This will find the position of the index that it should start scanning at.
-bool SStable::find_partition_in_summary(int64_t & found, const Partitioner & partitioner, const std::string & prefix, const CassandraParser::Token & first_token, const std::string & first_key)
+// The summary is a separate file that records a small subset of the keys in the index, with their positions in it,
+// in order to find a starting position in the index faster.
+std::shared_ptr<const IndexSummary> IndexSummary::load(const std::string & path, int version, const Partitioner & partitioner)
 {
-    // If there is a summary, use it to find the key faster
-    UncompressedBuffer summary_buffer((prefix + SUMMARY_SUFFIX).c_str());
+    std::unique_ptr<Buffer> summary_file = Buffer::open_file((path + SUMMARY_SUFFIX).c_str(), true);
+    Buffer & summary_buffer = *summary_file;
     if (!summary_buffer.good())
     {
-        return false;
+        return nullptr;
     }
 
     summary_buffer.skip_bytes(4);
-    int32_t size = summary_buffer.read_int();
-    int32_t memSize = (int32_t)summary_buffer.read_longlong();
+    const int32_t size = summary_buffer.read_int();
+    const int32_t memSize = (int32_t)summary_buffer.read_longlong();
 
-    if (config.version >= VERSION_KA)
+    if (version >= VERSION_KA)
         summary_buffer.skip_bytes(8);
 
     // Summary is designed to keep in memory, so this is safe.
     // Also, all offsets are native-endian.
     const char * toc = (const char *)summary_buffer.read_bytes(memSize);
-    if (toc == nullptr)
+    if (toc == nullptr || size < 0 || int64_t(size) * 4 > memSize)
     {
-        return false;
+        return nullptr;
     }
 
-    const int32_t * index = (const int32_t *)toc;
-
-    const uint8_t * lower_bounds = NULL;
-    int32_t bottom = 0, top = size - 1;
-    // Do a quick binary sort here to find the lower bounds.
-    while (bottom < top)
+    std::shared_ptr<IndexSummary> summary = std::make_shared<IndexSummary>();
+    summary->key_offsets.reserve(size + 1);
+    summary->positions.reserve(size);
+    summary->key_offsets.push_back(0);
+    for (int32_t i = 0; i < size; i++)
     {
-        const int32_t middle = bottom + (top - bottom) / 2;
-        const int32_t offset = index[middle];
-        const int32_t next_offset = middle + 1 == size ? memSize : index[middle + 1];
-        assert(next_offset <= memSize);
-        assert(offset < next_offset);
+        int32_t offset, next_offset;
+        memcpy(&offset, toc + 4 * i, sizeof(offset));
+        if (i + 1 == size)
+            next_offset = memSize;
+        else
+            memcpy(&next_offset, toc + 4 * (i + 1), sizeof(next_offset));
+        if (offset < size * 4 || next_offset > memSize || next_offset - offset < 8)
+        {
+            return nullptr;
+        }
+
         const size_t len = next_offset - offset - 8;
+        int64_t position;
+        memcpy(&position, toc + offset + len, sizeof(position));
+        summary->keys.append(toc + offset, len);
+        summary->key_offsets.push_back(uint32_t(summary->keys.size()));
+        summary->positions.push_back(position);
+    }
 
-        CassandraParser::Token token;
-        partitioner.assign_token(token, toc + offset, len);
-        int comp = partitioner.compare_token(first_token, first_key, token, std::string(toc + offset, len));
-        if (comp >= 0)
-            lower_bounds = (uint8_t *)(toc + offset + len);
+    // The keys are hashed together now, so that a search compares tokens without hashing anything.
+    std::vector<StringView> key_views(size);
+    for (int32_t i = 0; i < size; i++)
+    {
+        key_views[i] = StringView(summary->keys.data() + summary->key_offsets[i], summary->key_offsets[i + 1] - summary->key_offsets[i]);
+    }
+    summary->tokens.resize(size);
+    partitioner.assign_tokens(summary->tokens.data(), key_views.data(), size);
+    return summary;
+}
 
-        if (comp < 0)
-            top = middle - 1;
-        else if (comp > 0)
+bool IndexSummary::find(int64_t & position, const CassandraParser::Token & first_token, const std::string & first_key) const
+{
+    // The last sample at or before the key, as the scan of the index goes forwards from there.
+    size_t bottom = 0, top = positions.size();
+    while (bottom < top)
+    {
+        const size_t middle = bottom + (top - bottom) / 2;
+        const StringView key(keys.data() + key_offsets[middle], key_offsets[middle + 1] - key_offsets[middle]);
+        if (Partitioner::compare_token(first_token, first_key, tokens[middle], key) >= 0)
             bottom = middle + 1;
         else
-            break;
+            top = middle;
     }
 
-    if (lower_bounds)
+    if (bottom == 0)
     {
-        found = *(int64_t *)lower_bounds;
-        return true;
+        return false;
     }
-    return false;
+    position = positions[bottom - 1];
+    return true;
+}
+
+// This will find the position of the index that it should start scanning at.
+bool SStable::find_partition_in_summary(int64_t & found, const Partitioner & partitioner, const CassandraParser::Token & first_token, const std::string & first_key)
+{
+    std::call_once(*config.summary_loaded, [&]()
+    {
+        config.summary = IndexSummary::load(config.path, config.version, partitioner);
+    });
+    return config.summary && config.summary->find(found, first_token, first_key);
+}
+
+// From KA on, Summary.db ends with the first and last keys of the table. Reading the first from there is much cheaper
+// than opening the data and decompressing its first chunk.
+bool SStable::read_summary_keys(const std::string & path, int version, std::string & first_key, std::string & last_key)
+{
+    if (version < VERSION_KA)
+    {
+        return false;
+    }
+
+    std::unique_ptr<Buffer> summary_file = Buffer::open_file((path + SUMMARY_SUFFIX).c_str(), false);
+    Buffer & summary_buffer = *summary_file;
+    if (!summary_buffer.good())
+    {
+        return false;
+    }
+
+    summary_buffer.skip_bytes(8); // minIndexInterval and size
+    const int64_t memSize = summary_buffer.read_longlong();
+    summary_buffer.skip_bytes(8 + memSize); // samplingLevel, fullSamplingSummarySize and the summary itself
+
+    for (std::string * key : { &first_key, &last_key })
+    {
+        const int32_t len = summary_buffer.read_int();
+        const uint8_t * data = len > 0 ? summary_buffer.read_bytes(len) : nullptr;
+        if (data == nullptr)
+        {
+            first_key.clear();
+            last_key.clear();
+            return false;
+        }
+        key->assign(reinterpret_cast<const char *>(data), len);
+    }
+    return true;
 }
 
 static bool isSSTableVersion(const char * versionString, const char lowerBound)
@@ -272,7 +432,7 @@ static void skip_histogram(Buffer & buffer)
     buffer.skip_bytes(num_cols * 2 * 8);
 }
 
-const Partitioner * SStable::read_metadata(Buffer & buf, int version, TableSchema & schema)
+const Partitioner * SStable::read_metadata(Buffer & buf, int version, EncodingStats & stats, TableSchema & schema)
 {
     if (version >= VERSION_KA)
     {
@@ -300,7 +460,7 @@ const Partitioner * SStable::read_metadata(Buffer & buf, int version, TableSchem
         if (header_offset >= 0)
         {
             buf.seek(header_offset);
-            schema.parse(buf);
+            schema.parse(buf, stats);
         }
 
         if (validation_offset < 0)
@@ -338,9 +498,10 @@ bool OldSStable::read_row(const Partitioner * pPartitioner)
 {
     assert(fsm == READ_ROW);
 
-    next_key_value = data_buffer->read_string();
+    const StringView key = data_buffer->read_string_view();
     if (data_buffer->is_eof())
         return true;
+    next_key_value.assign(key.data(), key.size());
 
     if (pPartitioner)
         pPartitioner->assign_token(next_token_value, next_key_value.data(), next_key_value.length());
@@ -383,41 +544,46 @@ bool OldSStable::read_column()
         }
         else
         {
-            next_column_info.name.clear();
+            next_column_info.name = StringView();
             return false;
         }
     }
 
     // ja and above use an empty column to terminate row.
-    next_column_info.name = data_buffer->read_string();
+    // The name is copied, as the reads that follow may leave the buffer's window. The copy reuses column_name's storage.
+    const StringView name = data_buffer->read_string_view();
+    column_name.assign(name.data(), name.size());
+    next_column_info.name = StringView();
 
-    if (next_column_info.name.empty())
+    if (column_name.empty())
     {
         fsm = READ_ROW; // No more data in this row!
         return false;
     }
 
     // This might be a compound path or a clustering path. As we support neither, just take the name itself.
-    for (size_t buffer_len = next_column_info.name.length(); buffer_len >= 2; )
+    for (size_t buffer_len = column_name.length(); buffer_len >= 2; )
     {
-        const size_t advanced = next_column_info.name.length() - buffer_len;
-        const uint8_t * bytes = reinterpret_cast<const uint8_t *>(next_column_info.name.data()) + advanced;
+        const size_t advanced = column_name.length() - buffer_len;
+        const uint8_t * bytes = reinterpret_cast<const uint8_t *>(column_name.data()) + advanced;
 
         const uint16_t len = (bytes[0] << 8) | bytes[1];
         if (buffer_len > len + 3u)
         {
-            // TODO: next_column_info.name.substr(advanced + 2u, len) is the path element
+            // TODO: column_name.substr(advanced + 2u, len) is the path element
             buffer_len -= len + 3u;
         }
         else
         {
             if (buffer_len == len + 3u)
             {
-                next_column_info.name = next_column_info.name.substr(advanced + 2u, len);
+                column_name.erase(0, advanced + 2u);
+                column_name.resize(len);
             }
             break;
         }
     }
+    next_column_info.name = column_name;
 
     uint8_t flags = data_buffer->read_byte();
     next_column_info.deleted = (flags & DELETION_MASK) != 0;
@@ -448,7 +614,7 @@ bool OldSStable::read_column()
 }
 
 
-bool OldSStable::read_column_data(std::string & data)
+bool OldSStable::read_column_data(StringView & data)
 {
     assert(fsm == READ_COLUMN_DATA);
     bool result = data_buffer->read_data(data);
@@ -468,9 +634,12 @@ void NewSStable::decode_column_subset(Buffer & buf, std::vector<bool> & subset,
         size_t column_count = n_columns - encoded;
         const bool is_positive = column_count < (n_columns / 2);
         subset.assign(n_columns, !is_positive);
-        for (size_t i = 0; i < column_count; i++)
+        static thread_local std::vector<uint64_t> indexes;
+        indexes.resize(column_count);
+        buf.read_unsigned_vints(indexes.data(), column_count);
+        for (uint64_t index : indexes)
         {
-            subset[buf.read_unsigned_vint()] = is_positive;
+            subset[index] = is_positive;
         }
     }
     else
@@ -490,12 +659,12 @@ void NewSStable::read_clustering_columns(size_t size)
     for (size_t clusteringColumn = 0; clusteringColumn < size; )
     {
         uint64_t clusteringHeader = data_buffer->read_unsigned_vint();
-        size_t limit = std::min(config.schema.clustering.size(), clusteringColumn + 32);
+        size_t limit = std::min(config.schema->clustering.size(), clusteringColumn + 32);
         for (int shift = 0; clusteringColumn < limit; clusteringColumn++, shift += 2)
         {
             if ((clusteringHeader & (3 << shift)) == 0)
             {
-                size_t skip = TableSchema::get_column_size(config.schema.clustering[clusteringColumn], *data_buffer);
+                size_t skip = TableSchema::get_column_size(config.schema->clustering[clusteringColumn], *data_buffer);
                 data_buffer->skip_bytes(skip);
             }
         }
@@ -506,9 +675,10 @@ bool NewSStable::read_row(const Partitioner * pPartitioner)
 {
     if (at_end_of_partition)
     {
-        next_key_value = data_buffer->read_string();
+        const StringView key = data_buffer->read_string_view();
         if (data_buffer->is_eof())
             return true;
+        next_key_value.assign(key.data(), key.size());
         data_buffer->skip_bytes(4); /* local_deletion */
         partition_marked_for_deletion = data_buffer->read_longlong();
 
@@ -564,6 +734,8 @@ bool NewSStable::read_marker()
     }
     next_column_info.clear_flags();
     next_column_info.range_tombstone = true;
+    next_column_info.name = StringView();
+    next_column_info.id = 0;
     fsm = READ_COLUMN;
     columns_present.clear();
     this_column_index = 0;
@@ -574,7 +746,7 @@ bool NewSStable::read_normal_row(uint8_t flags)
 {
     if (!is_static)
     {
-        read_clustering_columns(config.schema.clustering.size());
+        read_clustering_columns(config.schema->clustering.size());
     }
 
     data_buffer->read_unsigned_vint(); // rowsize (not needed)
@@ -584,17 +756,17 @@ bool NewSStable::read_normal_row(uint8_t flags)
     row_timestamp = 0;
     if (flags & HAS_TIMESTAMP)
     {
-        row_timestamp = data_buffer->read_unsigned_vint() + config.schema.minTimestamp;
+        row_timestamp = data_buffer->read_unsigned_vint() + config.stats.minTimestamp;
         if (flags & HAS_TTL)
         {
-            row_ttl = data_buffer->read_unsigned_vint() + config.schema.minTTL;
+            row_ttl = data_buffer->read_unsigned_vint() + config.stats.minTTL;
             data_buffer->read_unsigned_vint(); // localDeletionTime (not needed)
         }
     }
 
     if (flags & HAS_DELETION)
     {
-        row_marked_for_deletion = data_buffer->read_unsigned_vint() + config.schema.minTimestamp;
+        row_marked_for_deletion = data_buffer->read_unsigned_vint() + config.stats.minTimestamp;
         data_buffer->read_unsigned_vint(); // localDeletionTime (not needed)
     }
     else
@@ -602,7 +774,7 @@ bool NewSStable::read_normal_row(uint8_t flags)
         row_marked_for_deletion = partition_marked_for_deletion;
     }
 
-    const std::vector<std::pair<std::string, TableSchema::ColumnFormat>> & columns = is_static ? config.schema.static_columns : config.schema.regular_columns;
+    const std::vector<std::pair<std::string, TableSchema::ColumnFormat>> & columns = is_static ? config.schema->static_columns : config.schema->regular_columns;
     if (flags & HAS_ALL_COLUMNS)
     {
         columns_present.assign(columns.size(), true);
@@ -632,7 +804,7 @@ bool NewSStable::read_column()
 
     if(fsm == READ_COLUMN_DATA)
     {
-        std::string ignore;
+        StringView ignore;
         read_column_data(ignore);
     }
 
@@ -642,12 +814,14 @@ bool NewSStable::read_column()
     if (this_column_index >= columns_present.size())
     {
         fsm = READ_ROW;
-        next_column_info.name.clear();
+        next_column_info.name = StringView();
+        next_column_info.id = 0;
         return false;
     }
 
-    const std::vector<std::pair<std::string, TableSchema::ColumnFormat>> & columns = is_static ? config.schema.static_columns : config.schema.regular_columns;
+    const std::vector<std::pair<std::string, TableSchema::ColumnFormat>> & columns = is_static ? config.schema->static_columns : config.schema->regular_columns;
     next_column_info.name = columns[this_column_index].first;
+    next_column_info.id = (is_static ? config.schema->static_column_ids : config.schema->regular_column_ids)[this_column_index];
 
     uint8_t flags = data_buffer->read_byte();
     if (flags & USE_ROW_TIMESTAMP_MASK)
@@ -656,7 +830,7 @@ bool NewSStable::read_column()
     }
     else
     {
-        next_column_info.ts = data_buffer->read_unsigned_vint() + config.schema.minTimestamp;
+        next_column_info.ts = data_buffer->read_unsigned_vint() + config.stats.minTimestamp;
     }
 
     next_column_info.deleted = (flags & IS_DELETED_MASK) != 0;
@@ -674,7 +848,7 @@ bool NewSStable::read_column()
         }
         if (next_column_info.expiring)
         {
-            next_column_info.extra_data.expiration.ttl = static_cast<uint32_t>(data_buffer->read_unsigned_vint() + config.schema.minTTL);
+            next_column_info.extra_data.expiration.ttl = static_cast<uint32_t>(data_buffer->read_unsigned_vint() + config.stats.minTTL);
         }
     }
 
@@ -685,20 +859,20 @@ bool NewSStable::read_column()
     return true;
 }
 
-bool NewSStable::read_column_data(std::string & data)
+bool NewSStable::read_column_data(StringView & data)
 {
     if (fsm == READ_COLUMN)
     {
-        data.clear();
+        data = StringView();
     }
     else
     {
-        const std::vector<std::pair<std::string, TableSchema::ColumnFormat>> & columns = is_static ? config.schema.static_columns : config.schema.regular_columns;
-        size_t size = config.schema.get_column_size(columns[this_column_index].second, *data_buffer);
+        const std::vector<std::pair<std::string, TableSchema::ColumnFormat>> & columns = is_static ? config.schema->static_columns : config.schema->regular_columns;
+        size_t size = config.schema->get_column_size(columns[this_column_index].second, *data_buffer);
         const uint8_t * bytes = data_buffer->read_bytes(size);
         if (bytes)
         {
-            data.assign(reinterpret_cast<const char *>(bytes), size);
+            data = StringView(reinterpret_cast<const char *>(bytes), size);
         }
 
         this_column_index++;
@@ -25,6 +25,23 @@
 class Partitioner;
 struct TableConfig;
 
+// Summary.db's samples of Index.db, with their tokens worked out. It is read by the first seek into a table and then
+// shared, as each token range seeks into every table.
+class IndexSummary
+{
+    std::vector<CassandraParser::Token> tokens;
+    // Sample i's key is keys[key_offsets[i], key_offsets[i + 1]).
+    std::string keys;
+    std::vector<uint32_t> key_offsets;
+    std::vector<int64_t> positions;
+public:
+    // Returns null if the table has no summary, or it cannot be read.
+    static std::shared_ptr<const IndexSummary> load(const std::string & path, int version, const Partitioner & partitioner);
+    // Finds where in Index.db to start looking for the first key at or after first_token and first_key.
+    // Returns false if it comes before every sample, so the search has to start at the beginning.
+    bool find(int64_t & position, const CassandraParser::Token & first_token, const std::string & first_key) const;
+};
+
 class SStable
 {
 protected:
@@ -61,12 +78,20 @@ public:
     static bool extractKeyspaceAndTable(int version, const std::string& fileName, const std::string& dir_string,
                                         std::string& thisKeyspace, std::string& thisTable);
     static int getVersionFromFilename(const char * name);
-    static const Partitioner * read_metadata(Buffer & buf, int version, TableSchema & schema);
+    static const Partitioner * read_metadata(Buffer & buf, int version, EncodingStats & stats, TableSchema & schema);
+    // Tables without -CompressionInfo.db store their data uncompressed.
+    static bool is_compressed(const std::string & path);
+    // Parsed by the first open() of a table, and shared by every buffer reading it.
+    static std::shared_ptr<const CompressionInfo> load_compression_info(const std::string & path, int version);
+    // From MA on, Statistics.db has a schema that names every column.
+    static bool has_schema(int version);
+    static bool verify_digest(const TableConfig & config);
+    static bool read_summary_keys(const std::string & path, int version, std::string & first_key, std::string & last_key);
     bool init_at_key(const Partitioner & partitioner, const CassandraParser::Token & first_token, const std::string & first_key);
     bool init(const Partitioner & partitioner);
     bool open();
     void close();
-    bool find_partition_in_summary(int64_t & found, const Partitioner & partitioner, const std::string & prefix, const CassandraParser::Token & first_token, const std::string & first_key);
+    bool find_partition_in_summary(int64_t & found, const Partitioner & partitioner, const CassandraParser::Token & first_token, const std::string & first_key);
     bool has_columns() const { return fsm != READ_ROW; }
 
     const CassandraParser::Token & next_token() const { return next_token_value; }
@@ -76,7 +101,12 @@ public:
 
     virtual bool read_row(const Partitioner * pPartitioner) = 0;
     virtual bool read_column() = 0;
-    virtual bool read_column_data(std::string & data) = 0;
+    // data is only valid until the table is read again, unless block_of(data) is kept.
+    virtual bool read_column_data(StringView & data) = 0;
+    const SharedBlock & block_of(const StringView & data) const
+    {
+        return data_buffer->block_of(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+    }
     virtual std::unique_ptr<SStable> duplicate() = 0;
 };
 
@@ -93,13 +123,20 @@ class OldSStable : public SStable
         RANGE_TOMBSTONE_MASK = 0x10
     };
     size_t remaining_columns; // Note: This is only valid for ancient versions
+    std::string column_name; // next_column_info.name refers to this
 public:
     OldSStable(const TableConfig & config) : SStable(config),
     remaining_columns(0)
     {}
+    OldSStable(const OldSStable & other) : SStable(other),
+    remaining_columns(other.remaining_columns),
+    column_name(other.column_name)
+    {
+        next_column_info.name = other.next_column_info.name.empty() ? StringView() : StringView(column_name);
+    }
     bool read_row(const Partitioner * pPartitioner) override;
     bool read_column() override;
-    bool read_column_data(std::string & data) override;
+    bool read_column_data(StringView & data) override;
     std::unique_ptr<SStable> duplicate() override
     {
         return std::unique_ptr<SStable>(new OldSStable(*this));
@@ -147,7 +184,7 @@ public:
     bool read_marker();
     bool read_normal_row(uint8_t flags);
     bool read_column() override;
-    bool read_column_data(std::string & data) override;
+    bool read_column_data(StringView & data) override;
     std::unique_ptr<SStable> duplicate() override
     {
         return std::unique_ptr<SStable>(new NewSStable(*this));
@@ -118,11 +118,11 @@ void TableSchema::read_columns(Buffer & buf, std::vector<std::pair<std::string,
     }
 }
 
-void TableSchema::parse(Buffer & buf)
+void TableSchema::parse(Buffer & buf, EncodingStats & stats)
 {
-    minTimestamp = buf.read_unsigned_vint();
+    stats.minTimestamp = buf.read_unsigned_vint();
     buf.read_unsigned_vint(); // minLocalDeletionTime
-    minTTL = buf.read_unsigned_vint();
+    stats.minTTL = buf.read_unsigned_vint();
 
     keyType = read_column_format(buf);
     uint64_t nClusteringTypes = buf.read_unsigned_vint();
@@ -134,3 +134,11 @@ void TableSchema::parse(Buffer & buf)
     read_columns(buf, static_columns);
     read_columns(buf, regular_columns);
 }
+
+bool TableSchema::operator==(const TableSchema & other) const
+{
+    return keyType == other.keyType &&
+           clustering == other.clustering &&
+           static_columns == other.static_columns &&
+           regular_columns == other.regular_columns;
+}
@@ -23,6 +23,15 @@
 
 class Buffer;
 
+// What the times in a table are stored relative to. This is part of the serialization header, but differs from
+// table to table even where the schema is the same.
+struct EncodingStats
+{
+    EncodingStats() : minTimestamp(0), minTTL(0) {}
+    uint64_t minTimestamp;
+    uint64_t minTTL;
+};
+
 // This is used by format MA and above to signified how each column is streamed
 struct TableSchema
 {
@@ -40,17 +49,22 @@ struct TableSchema
         COLUMN_UNKNOWN
     };
 
-    void parse(Buffer & buf);
+    void parse(Buffer & buf, EncodingStats & stats);
+    // True if the columns are the same (the column ids are not compared).
+    bool operator==(const TableSchema & other) const;
     static void read_columns(Buffer & buf, std::vector<std::pair<std::string, ColumnFormat>> & columns);
     static ColumnFormat read_column_format(Buffer & buf);
     static size_t get_column_size(ColumnFormat column, Buffer & buf);
 
-    uint64_t minTimestamp;
-    uint64_t minTTL;
+    TableSchema() : keyType(COLUMN_UNKNOWN) {}
+
     ColumnFormat keyType;
     std::vector<ColumnFormat> clustering;
     std::vector<std::pair<std::string, ColumnFormat>> static_columns;
     std::vector<std::pair<std::string, ColumnFormat>> regular_columns;
+    // Where each column is in the parser's column dictionary.
+    std::vector<uint32_t> static_column_ids;
+    std::vector<uint32_t> regular_column_ids;
 };
 
 #endif /* SSTableSchema_hpp */
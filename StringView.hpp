@@ -0,0 +1,84 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  StringView.hpp
+//  A pointer and length referring to characters owned by something else.
+
+#ifndef StringView_hpp
+#define StringView_hpp
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+// Like C++17's std::string_view, of which this is the small part that is needed.
+// Views into a Buffer are only valid until the next read from it.
+class StringView
+{
+    const char * m_data;
+    size_t m_size;
+public:
+    StringView() : m_data(""), m_size(0) {}
+    StringView(const char * data, size_t size) : m_data(data), m_size(size) {}
+    StringView(const std::string & string) : m_data(string.data()), m_size(string.size()) {}
+
+    const char * data() const { return m_data; }
+    size_t size() const { return m_size; }
+    size_t length() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    char operator[](size_t i) const { return m_data[i]; }
+
+    std::string to_string() const
+    {
+        return std::string(m_data, m_size);
+    }
+
+    // Orders bytes as unsigned, the same as strcmp.
+    int compare(const StringView & other) const
+    {
+        const int comparison = memcmp(m_data, other.m_data, std::min(m_size, other.m_size));
+        if (comparison != 0)
+        {
+            return comparison;
+        }
+        return m_size < other.m_size ? -1 : m_size > other.m_size ? 1 : 0;
+    }
+
+    bool operator==(const StringView & other) const
+    {
+        return m_size == other.m_size && memcmp(m_data, other.m_data, m_size) == 0;
+    }
+    bool operator!=(const StringView & other) const
+    {
+        return !(*this == other);
+    }
+};
+
+// FNV-1a, for unordered containers keyed by views.
+struct StringViewHash
+{
+    size_t operator()(const StringView & view) const
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < view.size(); i++)
+        {
+            hash = (hash ^ uint8_t(view[i])) * 1099511628211ULL;
+        }
+        return size_t(hash);
+    }
+};
+
+#endif /* StringView_hpp */
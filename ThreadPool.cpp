@@ -0,0 +1,103 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ThreadPool.cpp
+//  A fixed set of worker threads running queued tasks.
+
+#include "ThreadPool.hpp"
+
+#include <errno.h>
+#include <stdio.h>
+
+ThreadPool::ThreadPool(size_t n_threads) :
+    m_stopping(false)
+{
+    pthread_mutex_init(&m_mutex, nullptr);
+    pthread_cond_init(&m_has_tasks, nullptr);
+
+    m_threads.reserve(n_threads);
+    for (size_t i = 0; i < n_threads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, &ThreadPool::thread_main, this) != 0)
+        {
+            fprintf(stderr, "ERROR: cannot create worker thread %d\n", errno);
+            break;
+        }
+        m_threads.push_back(thread);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_stopping = true;
+    pthread_cond_broadcast(&m_has_tasks);
+    pthread_mutex_unlock(&m_mutex);
+
+    for (pthread_t thread : m_threads)
+    {
+        pthread_join(thread, nullptr);
+    }
+
+    pthread_cond_destroy(&m_has_tasks);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    if (m_threads.empty())
+    {
+        // No threads could be started, so do it here rather than never.
+        task();
+        return;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_tasks.push_back(std::move(task));
+    pthread_cond_signal(&m_has_tasks);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void * ThreadPool::thread_main(void * pool)
+{
+    static_cast<ThreadPool *>(pool)->run();
+    return nullptr;
+}
+
+void ThreadPool::run()
+{
+    pthread_mutex_lock(&m_mutex);
+    while (true)
+    {
+        while (m_tasks.empty() && !m_stopping)
+        {
+            pthread_cond_wait(&m_has_tasks, &m_mutex);
+        }
+
+        if (m_tasks.empty())
+        {
+            break;
+        }
+
+        std::function<void()> task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        pthread_mutex_unlock(&m_mutex);
+
+        task();
+
+        pthread_mutex_lock(&m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
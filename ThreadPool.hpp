@@ -0,0 +1,51 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ThreadPool.hpp
+//  A fixed set of worker threads running queued tasks.
+
+#ifndef ThreadPool_hpp
+#define ThreadPool_hpp
+
+#include <pthread.h>
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+class ThreadPool
+{
+    std::vector<pthread_t> m_threads;
+    std::deque<std::function<void()>> m_tasks;
+    pthread_mutex_t m_mutex;
+    pthread_cond_t m_has_tasks;
+    bool m_stopping;
+
+    ThreadPool(const ThreadPool & other) = delete;
+    ThreadPool operator=(const ThreadPool & other) = delete;
+
+    static void * thread_main(void * pool);
+    void run();
+public:
+    explicit ThreadPool(size_t n_threads);
+    // Runs any tasks still queued, then joins the threads.
+    ~ThreadPool();
+
+    size_t size() const { return m_threads.size(); }
+
+    // Tasks are started in the order they were submitted.
+    void submit(std::function<void()> task);
+};
+
+#endif /* ThreadPool_hpp */
@@ -0,0 +1,120 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  TokenRanges.cpp
+//  Hands out parts of the token ring so that they may be merged in parallel.
+
+#include "TokenRanges.hpp"
+
+#include <algorithm>
+
+TokenRangeScheduler::TokenRangeScheduler(const CassandraParser & parser, size_t n_ranges, const char * first_key) :
+    m_parser(parser),
+    m_next_range(0)
+{
+    std::vector<CassandraParser::TokenRange> ranges;
+    parser.split_token_ring(ranges, std::max(n_ranges, size_t(1)), first_key);
+
+    m_ranges.resize(ranges.size());
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        m_ranges[i].range = ranges[i];
+        m_ranges[i].state = PENDING;
+    }
+
+    pthread_mutex_init(&m_mutex, nullptr);
+}
+
+TokenRangeScheduler::~TokenRangeScheduler()
+{
+    pthread_mutex_destroy(&m_mutex);
+}
+
+CassandraParser::iterator * TokenRangeScheduler::next_range(size_t & range_index)
+{
+    pthread_mutex_lock(&m_mutex);
+    range_index = m_next_range;
+    if (m_next_range < m_ranges.size())
+    {
+        m_ranges[m_next_range++].state = STARTED;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    if (range_index >= m_ranges.size())
+    {
+        return nullptr;
+    }
+
+    // Seeking every table to the start of the range is slow, so this is done outside of the lock.
+    Range & range = m_ranges[range_index];
+    range.iterator.reset(new CassandraParser::iterator(m_parser.find_range(range.range)));
+    return range.iterator.get();
+}
+
+void TokenRangeScheduler::finish_range(size_t range_index)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_ranges[range_index].state = FINISHED;
+    pthread_mutex_unlock(&m_mutex);
+}
+
+size_t TokenRangeScheduler::getSkippedRecords() const
+{
+    size_t total = 0;
+    for (const Range & range : m_ranges)
+    {
+        if (range.iterator)
+        {
+            total += range.iterator->getSkippedRecords();
+        }
+    }
+    return total;
+}
+
+size_t TokenRangeScheduler::getCassandraReadRecords() const
+{
+    size_t total = 0;
+    for (const Range & range : m_ranges)
+    {
+        if (range.iterator)
+        {
+            total += range.iterator->getCassandraReadRecords();
+        }
+    }
+    return total;
+}
+
+bool TokenRangeScheduler::get_next_key(std::string & key, size_t & range_index)
+{
+    for (range_index = 0; range_index < m_ranges.size(); range_index++)
+    {
+        Range & range = m_ranges[range_index];
+        if (range.state == FINISHED)
+        {
+            continue;
+        }
+
+        if (!range.iterator)
+        {
+            range.iterator.reset(new CassandraParser::iterator(m_parser.find_range(range.range)));
+        }
+
+        // Ranges may turn out to be empty.
+        if (range.iterator->get_next_key(key))
+        {
+            return true;
+        }
+    }
+    return false;
+}
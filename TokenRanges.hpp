@@ -0,0 +1,69 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  TokenRanges.hpp
+//  Hands out parts of the token ring so that they may be merged in parallel.
+
+#ifndef TokenRanges_hpp
+#define TokenRanges_hpp
+
+#include "CassandraParser.hpp"
+
+#include <pthread.h>
+
+// The token ring is split into many more ranges than there are workers. Each worker takes the next range
+// that nobody has started, so a worker stuck on a large range does not hold up the others.
+class TokenRangeScheduler
+{
+    enum RangeState
+    {
+        PENDING,
+        STARTED,
+        FINISHED
+    };
+
+    struct Range
+    {
+        CassandraParser::TokenRange range;
+        std::unique_ptr<CassandraParser::iterator> iterator;
+        RangeState state;
+    };
+
+    const CassandraParser & m_parser;
+    std::vector<Range> m_ranges;
+    size_t m_next_range;
+    pthread_mutex_t m_mutex;
+
+    TokenRangeScheduler(const TokenRangeScheduler & other) = delete;
+    TokenRangeScheduler operator=(const TokenRangeScheduler & other) = delete;
+public:
+    TokenRangeScheduler(const CassandraParser & parser, size_t n_ranges, const char * first_key);
+    ~TokenRangeScheduler();
+
+    // Returns an iterator over the next range that has not been started (or nullptr if there are none left).
+    // The iterator remains owned by the scheduler.
+    CassandraParser::iterator * next_range(size_t & range_index);
+    // Called once every row of a range has been taken from its iterator.
+    void finish_range(size_t range_index);
+
+    size_t size() const { return m_ranges.size(); }
+    size_t getSkippedRecords() const;
+    size_t getCassandraReadRecords() const;
+
+    // Finds the next key of the first range that has not been completely read.
+    // Must only be called when no worker is using an iterator.
+    bool get_next_key(std::string & key, size_t & range_index);
+};
+
+#endif /* TokenRanges_hpp */
@@ -17,7 +17,7 @@
 
 #include "Utilities.hpp"
 
-std::string binaryToHex(const std::string& bin)
+std::string binaryToHex(const StringView& bin)
 {
     std::string hex;
     hex.reserve(bin.size() * 2);
@@ -30,7 +30,7 @@ std::string binaryToHex(const std::string& bin)
     return hex;
 }
 
-bool isPrintable(const std::string& val)
+bool isPrintable(const StringView& val)
 {
     for (size_t i = 0; i < val.size(); ++i)
         if (val[i] < ' ' || val[i] >= 0x7f)
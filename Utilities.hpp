@@ -18,10 +18,12 @@
 #ifndef Utilities_hpp
 #define Utilities_hpp
 
+#include "StringView.hpp"
+
 #include <string>
 
-std::string binaryToHex(const std::string& bin);
-bool isPrintable(const std::string& val);
+std::string binaryToHex(const StringView& bin);
+bool isPrintable(const StringView& val);
 bool hex_nibble_to_nibble(uint8_t & nibble_out, const char hex_nibble_in);
 
 #endif
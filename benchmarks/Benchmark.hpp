@@ -0,0 +1,49 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  Benchmark.hpp
+//  Microbenchmarks of the hot paths, each checked against the implementation it replaces.
+
+#ifndef Benchmark_hpp
+#define Benchmark_hpp
+
+#include <stddef.h>
+
+#include <chrono>
+
+// Each benchmark prints its timings and returns false if the fast path disagreed with the reference.
+bool benchmark_checksums();
+bool benchmark_partitioners();
+bool benchmark_vints();
+
+// The best of a few rounds of calling body(), in nanoseconds per item when each call handles n_items.
+template<class Body>
+double time_per_item(size_t n_items, Body body)
+{
+    const int ROUNDS = 5;
+    double best = 0;
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        body();
+        const double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        if (round == 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+    return best / n_items;
+}
+
+#endif /* Benchmark_hpp */
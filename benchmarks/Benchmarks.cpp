@@ -0,0 +1,57 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  Benchmarks.cpp
+//  Runs the microbenchmarks named on the command line, or all of them.
+
+#include "Benchmark.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+struct NamedBenchmark
+{
+    const char * name;
+    bool (*run)();
+};
+
+static const NamedBenchmark benchmarks[] =
+{
+    { "checksums", benchmark_checksums },
+    { "partitioners", benchmark_partitioners },
+    { "vints", benchmark_vints },
+};
+
+int main(int argc, char * argv[])
+{
+    bool passed = true;
+    for (const NamedBenchmark & benchmark : benchmarks)
+    {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; i++)
+        {
+            selected = selected || strcmp(argv[i], benchmark.name) == 0;
+        }
+        if (selected)
+        {
+            printf("%s:\n", benchmark.name);
+            if (!benchmark.run())
+            {
+                fprintf(stderr, "%s: the results do not match\n", benchmark.name);
+                passed = false;
+            }
+        }
+    }
+    return passed ? 0 : 1;
+}
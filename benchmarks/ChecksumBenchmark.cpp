@@ -0,0 +1,83 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  ChecksumBenchmark.cpp
+//  Compares fast_crc32() and fast_adler32() with zlib.
+
+#include "Benchmark.hpp"
+#include "../Checksum.hpp"
+
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <zlib.h>
+
+bool benchmark_checksums()
+{
+    std::mt19937 random(1);
+    std::vector<uint8_t> data(1024 * 1024 + 64);
+    for (uint8_t & byte : data)
+    {
+        byte = uint8_t(random());
+    }
+
+    // Every length up to a few vector widths, at every alignment, and some longer ones, continuing from odd starts.
+    bool matched = true;
+    for (size_t offset = 0; offset < 64; offset++)
+    {
+        for (size_t len = 0; len < 300 + 4096 * (offset % 3); len += len < 300 ? 1 : 4093)
+        {
+            const uint32_t start = uint32_t(random());
+            const uint8_t * bytes = data.data() + offset;
+            if (fast_crc32(start, bytes, len) != crc32(start, bytes, uInt(len)) ||
+                fast_adler32(start % 65521 | (start >> 16) % 65521 << 16, bytes, len) !=
+                adler32(start % 65521 | (start >> 16) % 65521 << 16, bytes, uInt(len)))
+            {
+                fprintf(stderr, "Checksums differ for %zu bytes at offset %zu\n", len, offset);
+                matched = false;
+            }
+        }
+    }
+
+    // Chunks are 64KB by default. Each round checksums the whole buffer a chunk at a time.
+    const size_t sizes[] = { 4096, 65536 };
+    for (size_t size : sizes)
+    {
+        const size_t n_chunks = (data.size() - 64) / size;
+        volatile uint32_t sink = 0;
+        auto bytes_per_ns = [&](uint32_t (*checksum)(uint32_t, const uint8_t *, size_t))
+        {
+            return 1 / time_per_item(n_chunks * size, [&]()
+            {
+                uint32_t result = 0;
+                for (int repeat = 0; repeat < 20; repeat++)
+                {
+                    for (size_t chunk = 0; chunk < n_chunks; chunk++)
+                    {
+                        result += checksum(1, data.data() + chunk * size, size);
+                    }
+                }
+                sink = result;
+            }) * 20;
+        };
+        const double fast_crc = bytes_per_ns(fast_crc32);
+        const double zlib_crc = bytes_per_ns([](uint32_t crc, const uint8_t * bytes, size_t len) { return uint32_t(crc32(crc, bytes, uInt(len))); });
+        const double fast_adler = bytes_per_ns(fast_adler32);
+        const double zlib_adler = bytes_per_ns([](uint32_t adler, const uint8_t * bytes, size_t len) { return uint32_t(adler32(adler, bytes, uInt(len))); });
+        printf("  %6zu byte chunks: crc32 %.2f GB/s (zlib %.2f), adler32 %.2f GB/s (zlib %.2f)\n",
+               size, fast_crc, zlib_crc, fast_adler, zlib_adler);
+    }
+    return matched;
+}
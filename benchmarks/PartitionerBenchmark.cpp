@@ -0,0 +1,113 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  PartitionerBenchmark.cpp
+//  Compares hashing partition keys in batches with hashing them one at a time.
+
+#include "Benchmark.hpp"
+#include "../Partitioners.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// The index scan hashes this many keys at a time.
+static const size_t BATCH_SIZE = 8;
+
+static bool tokens_match(const CassandraParser::Token & a, const CassandraParser::Token & b)
+{
+    return a.high == b.high && a.low == b.low;
+}
+
+bool benchmark_partitioners()
+{
+    const char * const names[] =
+    {
+        "Murmur3Partitioner",
+        "RandomPartitioner",
+    };
+
+    // Mostly the short keys tables are made of, and then every length up to a few MD5 blocks past the longest
+    // that is hashed in lanes, so that each way a key can end is checked.
+    std::mt19937 random(1);
+    std::vector<std::string> key_strings(200000);
+    for (std::string & key : key_strings)
+    {
+        key.resize(8 + random() % 41);
+    }
+    for (size_t len = 0; len < 300; len++)
+    {
+        key_strings.push_back(std::string(len, ' '));
+    }
+    std::vector<StringView> keys;
+    for (std::string & key : key_strings)
+    {
+        for (char & c : key)
+        {
+            c = char(random());
+        }
+        keys.push_back(StringView(key.data(), key.size()));
+    }
+    const size_t n_keys = keys.size();
+
+    bool matched = true;
+    for (const char * name : names)
+    {
+        const Partitioner * partitioner = Partitioner::partitioner_from_name((std::string("org.apache.cassandra.dht.") + name).c_str());
+        std::vector<CassandraParser::Token> expected(n_keys);
+        std::vector<CassandraParser::Token> tokens(n_keys);
+        for (size_t i = 0; i < n_keys; i++)
+        {
+            partitioner->assign_token(expected[i], keys[i].data(), keys[i].size());
+        }
+
+        // Every batch size, as the last batch of a scan is often short.
+        for (size_t batch = 1; batch <= BATCH_SIZE; batch++)
+        {
+            for (size_t i = 0; i < n_keys; i += batch)
+            {
+                partitioner->assign_tokens(&tokens[i], &keys[i], std::min(batch, n_keys - i));
+            }
+            for (size_t i = 0; i < n_keys; i++)
+            {
+                if (!tokens_match(tokens[i], expected[i]))
+                {
+                    fprintf(stderr, "%s: batches of %zu give a different token for a %zu byte key\n", name, batch, keys[i].size());
+                    matched = false;
+                    break;
+                }
+            }
+        }
+
+        const double one_at_a_time = time_per_item(n_keys, [&]()
+        {
+            for (size_t i = 0; i < n_keys; i++)
+            {
+                partitioner->assign_token(tokens[i], keys[i].data(), keys[i].size());
+            }
+        });
+        const double batched = time_per_item(n_keys, [&]()
+        {
+            for (size_t i = 0; i < n_keys; i += BATCH_SIZE)
+            {
+                partitioner->assign_tokens(&tokens[i], &keys[i], std::min(BATCH_SIZE, n_keys - i));
+            }
+        });
+        printf("  %s: one at a time %.1f ns/key, batches of %zu %.1f ns/key\n",
+               name, one_at_a_time, BATCH_SIZE, batched);
+    }
+    return matched;
+}
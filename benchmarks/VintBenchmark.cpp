@@ -0,0 +1,172 @@
+//  Copyright 2019 ThreatMetrix
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+//  VintBenchmark.cpp
+//  Compares the single load vint decoder with the two step read it falls back to.
+
+#include "Benchmark.hpp"
+#include "../Buffer.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace
+{
+    // Exposes the fallback, which read_unsigned_vint() only uses near the end of the window.
+    class VintBuffer final : public MappedBuffer
+    {
+    public:
+        VintBuffer(const char * filename) : MappedBuffer(filename, true) {}
+        uint64_t read_unsigned_vint_two_step()
+        {
+            return read_unsigned_vint_slow();
+        }
+    };
+}
+
+// Written the way Cassandra writes them, independently of the decoders under test.
+static void encode_unsigned_vint(uint64_t value, std::vector<uint8_t> & bytes)
+{
+    int extra_bytes = 0;
+    while (extra_bytes < 8 && (value >> (7 * extra_bytes + 7)) != 0)
+    {
+        extra_bytes++;
+    }
+    const uint8_t leading_ones = uint8_t(0xff << (8 - extra_bytes));
+    bytes.push_back(extra_bytes == 8 ? 0xff : uint8_t(leading_ones | (value >> (8 * extra_bytes))));
+    for (int i = extra_bytes - 1; i >= 0; i--)
+    {
+        bytes.push_back(uint8_t(value >> (8 * i)));
+    }
+}
+
+// Returns the name of a temporary file holding bytes, or an empty string if it cannot be written.
+static std::string write_temp_file(const std::vector<uint8_t> & bytes)
+{
+    const char * directory = getenv("TMPDIR");
+    std::string name = std::string(directory ? directory : "/tmp") + "/vints.XXXXXX";
+    const int fd = mkstemp(&name[0]);
+    if (fd < 0)
+    {
+        return std::string();
+    }
+    const bool written = write(fd, bytes.data(), bytes.size()) == ssize_t(bytes.size());
+    close(fd);
+    if (!written)
+    {
+        unlink(name.c_str());
+        return std::string();
+    }
+    return name;
+}
+
+bool benchmark_vints()
+{
+    const size_t N_VINTS = 4 * 1024 * 1024;
+    const int max_bits[] = { 7, 28, 64 };
+
+    std::mt19937_64 random(1);
+    bool matched = true;
+    for (int bits : max_bits)
+    {
+        std::vector<uint64_t> expected(N_VINTS);
+        std::vector<uint8_t> bytes;
+        for (uint64_t & value : expected)
+        {
+            const int width = int(random() % (bits + 1));
+            value = width == 0 ? 0 : random() >> (64 - width);
+            encode_unsigned_vint(value, bytes);
+        }
+
+        const std::string name = write_temp_file(bytes);
+        if (name.empty())
+        {
+            fprintf(stderr, "Cannot write a temporary file\n");
+            return false;
+        }
+        VintBuffer mapped(name.c_str());
+        // Not mapped, so that vints straddle the edges of its window.
+        std::unique_ptr<Buffer> windowed = Buffer::open_file(name.c_str(), false);
+        unlink(name.c_str());
+
+        std::vector<uint64_t> values(N_VINTS);
+        auto check = [&](const char * decoder)
+        {
+            if (values != expected)
+            {
+                fprintf(stderr, "%s decoded %d bit vints wrongly\n", decoder, bits);
+                matched = false;
+            }
+        };
+
+        for (uint64_t & value : values)
+        {
+            value = mapped.read_unsigned_vint_two_step();
+        }
+        check("Two step read");
+        mapped.seek(0);
+        for (uint64_t & value : values)
+        {
+            value = mapped.read_unsigned_vint();
+        }
+        check("read_unsigned_vint");
+        mapped.seek(0);
+        mapped.read_unsigned_vints(values.data(), N_VINTS);
+        check("read_unsigned_vints");
+        for (uint64_t & value : values)
+        {
+            value = windowed->read_unsigned_vint();
+        }
+        check("read_unsigned_vint across windows");
+        windowed->seek(0);
+        windowed->read_unsigned_vints(values.data(), N_VINTS);
+        check("read_unsigned_vints across windows");
+
+        volatile uint64_t sink = 0;
+        const double two_step = time_per_item(N_VINTS, [&]()
+        {
+            mapped.seek(0);
+            uint64_t sum = 0;
+            for (size_t i = 0; i < N_VINTS; i++)
+            {
+                sum += mapped.read_unsigned_vint_two_step();
+            }
+            sink = sum;
+        });
+        const double single = time_per_item(N_VINTS, [&]()
+        {
+            mapped.seek(0);
+            uint64_t sum = 0;
+            for (size_t i = 0; i < N_VINTS; i++)
+            {
+                sum += mapped.read_unsigned_vint();
+            }
+            sink = sum;
+        });
+        const double batch = time_per_item(N_VINTS, [&]()
+        {
+            mapped.seek(0);
+            mapped.read_unsigned_vints(values.data(), N_VINTS);
+            sink = values.back();
+        });
+        printf("  <=%2d bits: two step %.2f ns/vint, single load %.2f, batch %.2f\n", bits, two_step, single, batch);
+    }
+    return matched;
+}